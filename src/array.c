@@ -2297,6 +2297,51 @@ PMOD_EXPORT struct array *append_array(struct array *a, struct svalue *s)
   return a;
 }
 
+/** Allocate an array of empty arrays, to be filled one row at a time
+ * with append_column_value().
+ *
+ * @param columns the number of columns
+ * @param rows the number of elements each column has room for
+ */
+PMOD_EXPORT struct array *allocate_columns(INT32 columns, INT32 rows)
+{
+  struct array *cols = allocate_array(columns);
+  INT32 i;
+  for (i = 0; i < columns; i++) {
+    /* Never the shared empty array, which must keep its type field. */
+    struct array *col = allocate_array_no_init(0, MAXIMUM(rows, 1));
+    col->type_field = 0;	/* Maintained by append_column_value(). */
+    SET_SVAL(ITEM(cols)[i], PIKE_T_ARRAY, 0, array, col);
+  }
+  cols->type_field = BIT_ARRAY;
+  return cols;
+}
+
+/** Move the value on top of the stack to the end of a column of an
+ * array from allocate_columns(). A full column gets twice the room,
+ * where resize_array() would add only one slot, so filling a column
+ * takes linear time.
+ *
+ * @param cols the array of columns
+ * @param i the column to append to
+ */
+PMOD_EXPORT void append_column_value(struct array *cols, INT32 i)
+{
+  struct array *col = ITEM(cols)[i].u.array;
+  INT32 size = col->size;
+  if (col->item + size >= col->real_item + col->malloced_size) {
+    struct array *a = low_allocate_array(size, size);
+    memcpy(ITEM(a), ITEM(col), size * sizeof(struct svalue));
+    a->type_field = col->type_field;
+    col->size = 0;
+    free_array(col);
+    col = ITEM(cols)[i].u.array = a;
+  }
+  col->type_field |= 1 << TYPEOF(Pike_sp[-1]);
+  move_svalue(ITEM(col) + size, --Pike_sp);
+  col->size = size + 1;
+}
+
 /** Automap assignments
  * This implements X[*] = ...[*]..
  * Assign elements in a at @level to elements from b at the same @level.
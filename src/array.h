@@ -182,6 +182,8 @@ void describe_index(struct array *a,
 void describe_array(struct array *a,struct processing *p,int indent);
 PMOD_EXPORT struct array *aggregate_array(INT32 args);
 PMOD_EXPORT struct array *append_array(struct array *a, struct svalue *s);
+PMOD_EXPORT struct array *allocate_columns(INT32 columns, INT32 rows);
+PMOD_EXPORT void append_column_value(struct array *cols, INT32 i);
 PMOD_EXPORT struct array *explode(struct pike_string *str,
 		       struct pike_string *del);
 PMOD_EXPORT struct pike_string *implode(struct array *a,struct pike_string *del);
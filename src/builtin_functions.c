@@ -48,6 +48,10 @@
 
 #include <errno.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_POLL
 #ifdef HAVE_POLL_H
 #include <poll.h>
@@ -1749,7 +1753,16 @@ PMOD_EXPORT void f_string_to_unicode(INT32 args)
     /* Just 8bit characters */
     len = in->len * 2;
     out = begin_shared_string(len);
-    if (len) {
+    if (byteorder ==
+#if (PIKE_BYTEORDER == 4321)
+	0	/* Big endian. */
+#else
+	1	/* Little endian. */
+#endif
+	) {
+      /* Native byte order -- plain widening. */
+      convert_0_to_1((p_wchar1 *)out->str, STR0(in), in->len);
+    } else if (len) {
       memset(out->str, 0, len);	/* Clear the upper (and lower) byte */
       for(i = in->len; i--;) {
 	out->str[i * 2 + 1 - byteorder] = in->str[i];
@@ -1848,6 +1861,27 @@ PMOD_EXPORT void f_string_to_unicode(INT32 args)
   push_string(out);
 }
 
+/* Returns 1 if all the len UTF16 code units in str are in the
+ * range 0..255 (after byte-swapping if swab is set).
+ */
+static int utf16_is_8bit(const p_wchar1 *str, ptrdiff_t len, int swab)
+{
+  p_wchar1 mask = swab?0x00ff:0xff00;
+  ptrdiff_t i = 0;
+#ifdef __SSE2__
+  __m128i m = _mm_set1_epi16((short)mask);
+  __m128i z = _mm_setzero_si128();
+  for (; i + 8 <= len; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, m), z)) != 0xffff)
+      return 0;
+  }
+#endif
+  for (; i < len; i++)
+    if (str[i] & mask) return 0;
+  return 1;
+}
+
 /*! @decl string unicode_to_string(string(0..255) s, int(0..2)|void byteorder)
  *!
  *!   Converts an UTF16 byte-stream into a string.
@@ -1941,6 +1975,22 @@ PMOD_EXPORT void f_unicode_to_string(INT32 args)
     surrmask = 0xfc00;
   }
 
+  if (utf16_is_8bit(str0, len/2, swab)) {
+    /* Only 8bit characters (and thus no surrogates). */
+    len /= 2;
+    out = begin_shared_string(len);
+    if (swab) {
+      for (i = 0; i < len; i++)
+	STR0(out)[i] = str0[i] >> 8;
+    } else {
+      convert_1_to_0(STR0(out), str0, len);
+    }
+    out = end_shared_string(out);
+    pop_n_elems(args);
+    push_string(out);
+    return;
+  }
+
   /* Count number of surrogates */
   for (i = len; i >= 4; i -= 2, str0++)
     if ( (str0[0]&surrmask) == surr1 &&
@@ -2179,6 +2229,11 @@ PMOD_EXPORT void f_string_to_utf8(INT32 args)
 			 "in the surrogate range and therefore invalid.\n",
 			 c, i);
       }
+    } else {
+      /* 7bit. Skip to the end of the run. */
+      ptrdiff_t run = ascii_prefix_length(src, in->len - i) - 1;
+      INC_PCHARP(src, run);
+      i += run;
     }
   }
   if (len == in->len) {
@@ -2192,8 +2247,16 @@ PMOD_EXPORT void f_string_to_utf8(INT32 args)
   for(i=0,src=MKPCHARP_STR(in); i < in->len; INC_PCHARP(src,1),i++) {
     unsigned INT32 c = EXTRACT_PCHARP(src);
     if (!(c & ~0x7f)) {
-      /* 7bit */
-      *dst++ = c;
+      /* 7bit. Copy the whole run. */
+      ptrdiff_t run = ascii_prefix_length(src, in->len - i);
+      switch(src.shift) {
+      case 0: memcpy(dst, src.ptr, run); break;
+      case 1: convert_1_to_0(dst, src.ptr, run); break;
+      case 2: convert_2_to_0(dst, src.ptr, run); break;
+      }
+      dst += run;
+      INC_PCHARP(src, run - 1);
+      i += run - 1;
     } else if (!(c & ~0x7ff)) {
       /* 11bit */
       *dst++ = 0xc0 | (c >> 6);
@@ -2485,6 +2548,12 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
 #undef GET_CHAR
 #undef GET_CONT_CHAR
 #undef UTF8_SEQ_ERROR
+    } else {
+      /* 7bit. Skip to the end of the run. */
+      ptrdiff_t run =
+	ascii_prefix_length(MKPCHARP(STR0(in) + i, 0), in->len - i) - 1;
+      len += run;
+      i += run;
     }
   }
   if (len == in->len) {
@@ -2495,11 +2564,25 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
 
   out = begin_wide_shared_string(len, shift);
 
+  /* Copies the 7bit run starting at in[i] with CONVERT. */
+#define COPY_7BIT_RUN(CONVERT) do {					\
+    ptrdiff_t run =							\
+      ascii_prefix_length(MKPCHARP(STR0(in) + i, 0), in->len - i);	\
+    CONVERT(out_str + j, STR0(in) + i, run);				\
+    i += run;								\
+    j += run;								\
+  } while (0)
+
   switch (shift) {
     case 0: {
       p_wchar0 *out_str = STR0 (out);
       for(i=0; i < in->len;) {
-	unsigned int c = STR0(in)[i++];
+	unsigned int c = STR0(in)[i];
+	if (!(c & 0x80)) {
+	  COPY_7BIT_RUN(convert_0_to_0);
+	  continue;
+	}
+	i++;
 	/* NOTE: No tests here since we've already tested the string above. */
 	if (c & 0x80) {
 	  /* 11bit */
@@ -2515,7 +2598,12 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
     case 1: {
       p_wchar1 *out_str = STR1 (out);
       for(i=0; i < in->len;) {
-	unsigned int c = STR0(in)[i++];
+	unsigned int c = STR0(in)[i];
+	if (!(c & 0x80)) {
+	  COPY_7BIT_RUN(convert_0_to_1);
+	  continue;
+	}
+	i++;
 	/* NOTE: No tests here since we've already tested the string above. */
 	if (c & 0x80) {
 	  if ((c & 0xe0) == 0xc0) {
@@ -2539,7 +2627,12 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
     case 2: {
       p_wchar2 *out_str = STR2 (out);
       for(i=0; i < in->len;) {
-	unsigned int c = STR0(in)[i++];
+	unsigned int c = STR0(in)[i];
+	if (!(c & 0x80)) {
+	  COPY_7BIT_RUN(convert_0_to_2);
+	  continue;
+	}
+	i++;
 	/* NOTE: No tests here since we've already tested the string above. */
 	if (c & 0x80) {
 	  int cont = 0;
@@ -2584,6 +2677,8 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
     }
   }
 
+#undef COPY_7BIT_RUN
+
 #ifdef PIKE_DEBUG
   if (j != len) {
     Pike_fatal("Calculated and actual lengths differ: "
@@ -29,6 +29,7 @@
 #include "dynamic_buffer.h"
 #include "operators.h"
 #include "bignum.h"
+#include "modules/_Stdio/buffer.h"
 
 #include <zlib.h>
 
@@ -56,6 +57,12 @@ struct memobj
 #define BUF 32768
 #define MAX_BUF	(64*BUF)
 
+/* Inputs smaller than this are packed and unpacked without releasing
+ * the interpreter lock, as switching threads would cost more than the
+ * work itself.
+ */
+#define GZ_THREADS_MIN 16384
+
 #undef THIS
 #define THIS ((struct zipper *)(Pike_fp->current_storage))
 
@@ -331,25 +338,22 @@ static void do_mt_unlock (PIKE_MUTEX_T *lock)
 }
 #endif
 
-static int do_deflate(dynamic_buffer *buf,
-		      struct zipper *this,
-		      int flush)
+/* Run deflate on the input in this->gz into buf. The caller must either
+ * hold this->lock or be the only user of the zipper.
+ */
+static int low_do_deflate(dynamic_buffer *buf,
+			  struct zipper *this,
+			  int flush)
 {
    int ret=0;
 
-#ifdef _REENTRANT
-   ONERROR uwp;
-   THREADS_ALLOW();
-   mt_lock(& this->lock);
-   THREADS_DISALLOW();
-   SET_ONERROR (uwp, do_mt_unlock, &this->lock);
-#endif
-
    if(!this->gz.state)
       ret=Z_STREAM_ERROR;
    else
       do
       {
+	 int threads = this->gz.avail_in >= GZ_THREADS_MIN;
+
 	 this->gz.next_out=(Bytef *)low_make_buf_space(
 	    /* recommended by the zlib people */
 	    (this->gz.avail_out =
@@ -358,9 +362,14 @@ static int do_deflate(dynamic_buffer *buf,
 	      4096),
 	    buf);
 
-	 THREADS_ALLOW();
-	 ret=deflate(& this->gz, flush);
-	 THREADS_DISALLOW();
+	 if(threads)
+	 {
+	   THREADS_ALLOW();
+	   ret=deflate(& this->gz, flush);
+	   THREADS_DISALLOW();
+	 }
+	 else
+	   ret=deflate(& this->gz, flush);
 
 	 /* Absorb any unused space /Hubbe */
 	 low_make_buf_space(-((ptrdiff_t)this->gz.avail_out), buf);
@@ -369,12 +378,115 @@ static int do_deflate(dynamic_buffer *buf,
       }
       while (ret==Z_OK && (this->gz.avail_in || !this->gz.avail_out));
 
+   return ret;
+}
+
+static int do_deflate(dynamic_buffer *buf,
+		      struct zipper *this,
+		      int flush)
+{
+   int ret;
+
+#ifdef _REENTRANT
+   ONERROR uwp;
+   THREADS_ALLOW();
+   mt_lock(& this->lock);
+   THREADS_DISALLOW();
+   SET_ONERROR (uwp, do_mt_unlock, &this->lock);
+#endif
+
+   ret=low_do_deflate(buf, this, flush);
+
 #ifdef _REENTRANT
    CALL_AND_UNSET_ONERROR (uwp);
 #endif
    return ret;
 }
 
+/* Run deflate or inflate from the Stdio.Buffer in into the Stdio.Buffer
+ * out, appending directly to out. The consumed input is removed from
+ * in. Both buffers are locked while the interpreter lock is released,
+ * so that other threads can not move their memory.
+ */
+static int do_zip_buffer(Buffer *in, Buffer *out,
+			 struct zipper *this,
+			 int do_inflate_data,
+			 int flush)
+{
+  int ret=0;
+
+#ifdef _REENTRANT
+  ONERROR uwp;
+  THREADS_ALLOW();
+  mt_lock(& this->lock);
+  THREADS_DISALLOW();
+  SET_ONERROR (uwp, do_mt_unlock, &this->lock);
+#endif
+
+  if(!this->gz.state)
+    ret=Z_STREAM_ERROR;
+  else
+    do
+    {
+      /* zlib counts with 32 bit lengths. */
+      size_t chunk = MINIMUM(io_len(in), 0x40000000);
+      size_t space = chunk + chunk/1000 + 4096;
+
+      this->gz.next_out = (Bytef *)io_add_space(out, space, 0);
+      this->gz.avail_out = (unsigned INT32)space;
+      this->gz.next_in = (Bytef *)io_read_pointer(in);
+      this->gz.avail_in = (unsigned INT32)chunk;
+
+      if(chunk >= GZ_THREADS_MIN)
+      {
+	in->locked++;
+	out->locked++;
+	THREADS_ALLOW();
+	if(do_inflate_data)
+	  ret=inflate(& this->gz, flush);
+	else
+	  ret=deflate(& this->gz, flush);
+	THREADS_DISALLOW();
+	in->locked--;
+	out->locked--;
+      }
+      else if(do_inflate_data)
+	ret=inflate(& this->gz, flush);
+      else
+	ret=deflate(& this->gz, flush);
+
+      out->len += space - this->gz.avail_out;
+      io_consume(in, (int)(chunk - this->gz.avail_in));
+
+      if(ret == Z_BUF_ERROR) ret=Z_OK;
+
+      if (do_inflate_data && ret == Z_NEED_DICT && this->dict)
+	ret = inflateSetDictionary(&this->gz,
+				   (const Bytef*)this->dict->str,
+				   this->dict->len);
+    }
+    while (ret==Z_OK && (io_len(in) || !this->gz.avail_out));
+
+  /* Do not leave pointers into the buffers behind. */
+  this->gz.next_in = NULL;
+  this->gz.avail_in = 0;
+
+#ifdef _REENTRANT
+  CALL_AND_UNSET_ONERROR (uwp);
+#endif
+  return ret;
+}
+
+static Buffer *get_buffer_arg(INT32 args, int n, const char *fun)
+{
+  Buffer *io;
+  struct svalue *s = Pike_sp + n - 1 - args;
+  if (TYPEOF(*s) != PIKE_T_OBJECT ||
+      !(io = io_buffer_from_object(s->u.object)))
+    SIMPLE_ARG_TYPE_ERROR(fun, n, "Stdio.Buffer");
+  return io;
+}
+
 void low_zlibmod_pack(struct memobj data, dynamic_buffer *buf,
                       int level, int strategy, int wbits)
 {
@@ -440,12 +552,10 @@ void low_zlibmod_pack(struct memobj data, dynamic_buffer *buf,
       Pike_error("Failed to initialize Gz.compress (%d).\n", ret);
   }
 
-  mt_init(&z.lock);
-
-  ret = do_deflate(buf, &z, Z_FINISH);
+  /* The zipper is private to this call, so there is no need to lock it. */
+  ret = low_do_deflate(buf, &z, Z_FINISH);
 
   deflateEnd(&z.gz);
-  mt_destroy(&z.lock);
 
   if(ret != Z_STREAM_END)
     Pike_error("Error while deflating data (%d).\n",ret);
@@ -695,6 +805,84 @@ static void gz_deflate(INT32 args)
 }
 
 
+/*! @decl int deflate_buffer(Stdio.Buffer data, Stdio.Buffer out, @
+ *!                          int|void flush)
+ *!
+ *! Streaming version of @[deflate()] that packs the contents of @[data]
+ *! directly into @[out], without creating any intermediate strings.
+ *! All of @[data] is consumed. The @[flush] argument is the same as for
+ *! @[deflate()].
+ *!
+ *! For large inputs the interpreter lock is released while packing.
+ *! Neither buffer may be modified by other threads during the call.
+ *!
+ *! @returns
+ *!   Returns the number of bytes added to @[out].
+ *!
+ *! @seealso
+ *!   @[Gz.inflate->inflate_buffer()]
+ */
+static void gz_deflate_buffer(INT32 args)
+{
+  Buffer *in, *out;
+  size_t before;
+  int flush = Z_FINISH, fail;
+  struct zipper *this=THIS;
+
+  if(args<2)
+    SIMPLE_WRONG_NUM_ARGS_ERROR("deflate_buffer", 2);
+
+  in = get_buffer_arg(args, 1, "deflate_buffer");
+  out = get_buffer_arg(args, 2, "deflate_buffer");
+  if(in == out)
+    Pike_error("The input and output buffers must differ.\n");
+
+  if(args>2)
+  {
+    if(TYPEOF(sp[2-args]) != T_INT)
+      SIMPLE_ARG_TYPE_ERROR("deflate_buffer", 3, "int");
+    flush=sp[2-args].u.integer;
+    switch(flush)
+    {
+    case Z_PARTIAL_FLUSH:
+    case Z_FINISH:
+    case Z_SYNC_FLUSH:
+    case Z_NO_FLUSH:
+      break;
+
+    default:
+      Pike_error("Argument 3 to gz_deflate->deflate_buffer() out of range.\n");
+    }
+  }
+
+  if(this->state == 1)
+  {
+    deflateEnd(& this->gz);
+    deflateInit(& this->gz, this->level);
+    this->state=0;
+  }
+
+  if(!this->gz.state)
+    Pike_error("gz_deflate not initialized or destructed\n");
+
+  before = io_len(out);
+  fail = do_zip_buffer(in, out, this, 0, flush);
+
+  if(fail != Z_OK && fail != Z_STREAM_END)
+  {
+    if(this->gz.msg)
+      Pike_error("Error in gz_deflate->deflate_buffer(): %s\n",this->gz.msg);
+    else
+      Pike_error("Error in gz_deflate->deflate_buffer(): %d\n",fail);
+  }
+
+  if(fail == Z_STREAM_END)
+    this->state=1;
+
+  pop_n_elems(args);
+  push_int64(io_len(out) - before);
+}
+
 static void init_gz_deflate(struct object *UNUSED(o))
 {
   mt_init(& THIS->lock);
@@ -847,41 +1035,36 @@ static void gz_inflate_create(INT32 args)
   }
 }
 
-static int do_inflate(dynamic_buffer *buf,
-		      struct zipper *this,
-		      int flush)
+/* Run inflate on the input in this->gz into buf. The caller must either
+ * hold this->lock or be the only user of the zipper.
+ */
+static int low_do_inflate(dynamic_buffer *buf,
+			  struct zipper *this,
+			  int flush)
 {
   int fail=0;
 
-#ifdef _REENTRANT
-  ONERROR uwp;
-  THREADS_ALLOW();
-  mt_lock(& this->lock);
-  THREADS_DISALLOW();
-  SET_ONERROR (uwp, do_mt_unlock, &this->lock);
-#endif
-
   if(!this->gz.state)
   {
     fail=Z_STREAM_ERROR;
   }else{
-#if 0
-  static int fnord=0;
-  fnord++;
-#endif
-
     do
     {
       char *loc;
       int ret;
       loc=low_make_buf_space(BUF,buf);
-      THREADS_ALLOW();
       this->gz.next_out=(Bytef *)loc;
       this->gz.avail_out=BUF;
 
-      ret=inflate(& this->gz, flush);
+      if(this->gz.avail_in >= GZ_THREADS_MIN)
+      {
+	THREADS_ALLOW();
+	ret=inflate(& this->gz, flush);
+	THREADS_DISALLOW();
+      }
+      else
+	ret=inflate(& this->gz, flush);
 
-      THREADS_DISALLOW();
       low_make_buf_space(-((ptrdiff_t)this->gz.avail_out), buf);
 
       if(ret == Z_BUF_ERROR) ret=Z_OK;
@@ -899,6 +1082,25 @@ static int do_inflate(dynamic_buffer *buf,
     } while(!this->gz.avail_out || flush==Z_FINISH || this->gz.avail_in);
   }
 
+  return fail;
+}
+
+static int do_inflate(dynamic_buffer *buf,
+		      struct zipper *this,
+		      int flush)
+{
+  int fail;
+
+#ifdef _REENTRANT
+  ONERROR uwp;
+  THREADS_ALLOW();
+  mt_lock(& this->lock);
+  THREADS_DISALLOW();
+  SET_ONERROR (uwp, do_mt_unlock, &this->lock);
+#endif
+
+  fail=low_do_inflate(buf, this, flush);
+
 #ifdef _REENTRANT
   CALL_AND_UNSET_ONERROR (uwp);
 #endif
@@ -944,9 +1146,8 @@ void low_zlibmod_unpack(struct memobj data, dynamic_buffer *buf, int raw)
       Pike_error("Failed to initialize Gz.uncompress (%d).\n", ret);
   }
 
-  mt_init(&z.lock);
-  ret = do_inflate(buf, &z, Z_SYNC_FLUSH);
-  mt_destroy(&z.lock);
+  /* The zipper is private to this call, so there is no need to lock it. */
+  ret = low_do_inflate(buf, &z, Z_SYNC_FLUSH);
   inflateEnd( &z.gz );
 
   if(ret==Z_OK)
@@ -1126,6 +1327,59 @@ static void gz_inflate(INT32 args)
   }
 }
 
+/*! @decl int inflate_buffer(Stdio.Buffer data, Stdio.Buffer out)
+ *!
+ *! Streaming version of @[inflate()] that unpacks the contents of
+ *! @[data] directly into @[out], without creating any intermediate
+ *! strings. The consumed input is removed from @[data]. Any data
+ *! following the end of stream marker is left in @[data], and is not
+ *! returned by @[end_of_stream()].
+ *!
+ *! For large inputs the interpreter lock is released while unpacking.
+ *! Neither buffer may be modified by other threads during the call.
+ *!
+ *! @returns
+ *!   Returns the number of bytes added to @[out].
+ *!
+ *! @seealso
+ *!   @[Gz.deflate->deflate_buffer()], @[end_of_stream()]
+ */
+static void gz_inflate_buffer(INT32 args)
+{
+  Buffer *in, *out;
+  size_t before;
+  int fail;
+  struct zipper *this=THIS;
+
+  if(!this->gz.state)
+    Pike_error("gz_inflate not initialized or destructed\n");
+
+  if(args<2)
+    SIMPLE_WRONG_NUM_ARGS_ERROR("inflate_buffer", 2);
+
+  in = get_buffer_arg(args, 1, "inflate_buffer");
+  out = get_buffer_arg(args, 2, "inflate_buffer");
+  if(in == out)
+    Pike_error("The input and output buffers must differ.\n");
+
+  before = io_len(out);
+  fail = do_zip_buffer(in, out, this, 1, Z_SYNC_FLUSH);
+
+  if(fail != Z_OK && fail != Z_STREAM_END)
+  {
+    if(this->gz.msg)
+      Pike_error("Error in gz_inflate->inflate_buffer(): %s\n",this->gz.msg);
+    else
+      Pike_error("Error in gz_inflate->inflate_buffer(): %d\n",fail);
+  }
+
+  if(fail == Z_STREAM_END && !this->epilogue)
+    copy_shared_string(this->epilogue, empty_pike_string);
+
+  pop_n_elems(args);
+  push_int64(io_len(out) - before);
+}
+
 /*! @decl string(8bit) end_of_stream()
  *!
  *! This function returns 0 if the end of stream marker has not yet
@@ -1170,60 +1424,101 @@ static void exit_gz_inflate(struct object *UNUSED(o))
 /*! @endclass
  */
 
-/*! @decl int crc32(string(8bit) data, void|int(0..) start_value)
+/* Calculate crc32 or adler32 of argument 1, continuing from argument
+ * 2 if given. Strings and Stdio.Buffer objects, which can not change
+ * under our feet, are checksummed without the interpreter lock when
+ * they are large.
+ */
+static void gz_checksum(INT32 args, const char *name, int adler)
+{
+  struct memobj data;
+  Buffer *io = NULL;
+  unsigned INT32 crc = adler ? 1 : 0;
+  int threads = 0;
+
+  if(args<1)
+    SIMPLE_WRONG_NUM_ARGS_ERROR(name, 1);
+
+  switch (TYPEOF(sp[-args]))
+  {
+    case PIKE_T_STRING:
+    {
+      struct pike_string *s = sp[-args].u.string;
+      data.ptr = (unsigned char*)s->str;
+      data.len = s->len;
+      data.shift = s->size_shift;
+      threads = 1;
+      break;
+    }
+    case PIKE_T_OBJECT:
+    {
+      enum memobj_type t = get_memory_object_memory(sp[-args].u.object,
+                                                    &data.ptr, &data.len,
+                                                    &data.shift);
+      if (t != MEMOBJ_NONE)
+      {
+        if ((io = io_buffer_from_object(sp[-args].u.object)))
+          threads = 1;
+        break;
+      }
+      // fall through
+    }
+    default:
+      SIMPLE_ARG_TYPE_ERROR(name, 1, "string|String.Buffer|System.Memory|Stdio.Buffer");
+  }
+  if (data.shift)
+    Pike_error("Cannot input wide string to Gz.%s\n", name);
+
+  if (args>1) {
+    if (TYPEOF(sp[1-args]) != T_INT)
+      SIMPLE_ARG_TYPE_ERROR(name, 2, "int");
+    crc=(unsigned INT32)sp[1-args].u.integer;
+  }
+
+  if (threads && data.len >= GZ_THREADS_MIN)
+  {
+    unsigned char *ptr = data.ptr;
+    size_t len = data.len;
+    if (io) io->locked++;
+    THREADS_ALLOW();
+    while (len)
+    {
+      /* zlib counts with 32 bit lengths. */
+      unsigned INT32 chunk = (unsigned INT32)MINIMUM(len, 0x40000000);
+      crc = adler ? adler32(crc, ptr, chunk) : crc32(crc, ptr, chunk);
+      ptr += chunk;
+      len -= chunk;
+    }
+    THREADS_DISALLOW();
+    if (io) io->locked--;
+  }
+  else if (adler)
+    crc=adler32(crc, data.ptr, (unsigned INT32)data.len);
+  else
+    crc=crc32(crc, data.ptr, (unsigned INT32)data.len);
+
+  pop_n_elems(args);
+  push_int64((INT64)crc);
+}
+
+/*! @decl int crc32(string(8bit)|String.Buffer|System.Memory|Stdio.Buffer data, @
+ *!                 void|int(0..) start_value)
  *!
  *!   This function calculates the standard ISO3309 Cyclic Redundancy Check.
  */
 static void gz_crc32(INT32 args)
 {
-   unsigned INT32 crc;
-   if (!args || TYPEOF(sp[-args]) != T_STRING)
-      Pike_error("Gz.crc32: illegal or missing argument 1 (expected string)\n");
-  if (sp[-args].u.string->size_shift)
-    Pike_error("Cannot input wide string to Gz.crc32\n");
-
-   if (args>1) {
-      if (TYPEOF(sp[1-args]) != T_INT)
-	 Pike_error("Gz.crc32: illegal argument 2 (expected integer)\n");
-      else
-	 crc=(unsigned INT32)sp[1-args].u.integer;
-   } else
-      crc=0;
-
-   crc=crc32(crc,
-	     (unsigned char*)sp[-args].u.string->str,
-             (unsigned INT32)(sp[-args].u.string->len));
-
-   pop_n_elems(args);
-   push_int64((INT64)crc);
+  gz_checksum(args, "crc32", 0);
 }
 
-/*! @decl int adler32(string(8bit) data, void|int(0..) start_value)
+/*! @decl int adler32(string(8bit)|String.Buffer|System.Memory|Stdio.Buffer data, @
+ *!                   void|int(0..) start_value)
  *!
  *!   This function calculates the Adler-32 Cyclic Redundancy Check.
  */
 static void gz_adler32(INT32 args)
 {
-   unsigned INT32 crc;
-   if (!args || TYPEOF(sp[-args]) != T_STRING)
-      Pike_error("Gz.adler32: illegal or missing argument 1 (expected string)\n");
-  if (sp[-args].u.string->size_shift)
-    Pike_error("Cannot input wide string to Gz.adler32\n");
-
-   if (args>1) {
-      if (TYPEOF(sp[1-args]) != T_INT)
-         Pike_error("Gz.adler32: illegal argument 2 (expected integer)\n");
-      else
-	 crc=(unsigned INT32)sp[1-args].u.integer;
-   } else
-      crc=1;
-
-   crc=adler32(crc,
-               (unsigned char*)sp[-args].u.string->str,
-               (unsigned INT32)(sp[-args].u.string->len));
-
-   pop_n_elems(args);
-   push_int64((INT64)crc);
+  gz_checksum(args, "adler32", 1);
 }
 
 static void gz_deflate_size( INT32 args )
@@ -1277,6 +1572,7 @@ PIKE_MODULE_INIT
   ADD_FUNCTION("clone", gz_deflate_clone, tFunc(tVoid,tObj), 0);
   /* function(string(8bit)|String.Buffer|System.Memory|Stdio.Buffer,int|void:string(8bit)) */
   ADD_FUNCTION("deflate",gz_deflate,tFunc(tOr(tStr8,tObj) tOr(tInt,tVoid),tStr8),0);
+  ADD_FUNCTION("deflate_buffer",gz_deflate_buffer,tFunc(tObj tObj tOr(tInt,tVoid),tInt),0);
   ADD_FUNCTION("_size_object", gz_deflate_size, tFunc(tVoid,tInt), 0);
 
   add_integer_constant("NO_FLUSH",Z_NO_FLUSH,0);
@@ -1315,6 +1611,7 @@ PIKE_MODULE_INIT
   ADD_FUNCTION("create",gz_inflate_create,tFunc(tOr(tMapping,tOr(tInt,tVoid)),tVoid),0);
   /* function(string(8bit)|String.Buffer|System.Memory|Stdio.Buffer:string(8bit)) */
   ADD_FUNCTION("inflate",gz_inflate,tFunc(tOr(tStr8,tObj),tStr8),0);
+  ADD_FUNCTION("inflate_buffer",gz_inflate_buffer,tFunc(tObj tObj,tInt),0);
   /* function(:string(8bit)) */
   ADD_FUNCTION("end_of_stream",gz_end_of_stream,tFunc(tNone,tStr8),0);
   ADD_FUNCTION("_size_object", gz_inflate_size, tFunc(tVoid,tInt), 0);
@@ -1350,8 +1647,8 @@ PIKE_MODULE_INIT
 #endif
 
   /* function(string(8bit),void|int:int) */
-  ADD_FUNCTION("crc32",gz_crc32,tFunc(tStr8 tOr(tVoid,tIntPos),tIntPos),0);
-  ADD_FUNCTION("adler32",gz_adler32,tFunc(tStr8 tOr(tVoid,tIntPos),tIntPos),0);
+  ADD_FUNCTION("crc32",gz_crc32,tFunc(tOr(tStr8,tObj) tOr(tVoid,tIntPos),tIntPos),0);
+  ADD_FUNCTION("adler32",gz_adler32,tFunc(tOr(tStr8,tObj) tOr(tVoid,tIntPos),tIntPos),0);
 
   /* function(string(8bit)|String.Buffer|System.Memory|Stdio.Buffer,void|int(0..1),void|int,void|int:string(8bit)) */
   ADD_FUNCTION("compress",gz_compress,tFunc(tOr(tStr8,tObj) tOr(tVoid,tInt01) tOr(tVoid,tInt09) tOr(tVoid,tInt) tOr(tVoid,tInt),tStr8),0);
@@ -69,6 +69,10 @@
 #include "util.h"
 #include "timeout.h"
 
+#ifdef AAP_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #endif /* _REENTRANT */
 
 
@@ -209,8 +213,11 @@ static int parse(struct args *arg)
      * This could cause trouble with the leftovers code below, so that
      * would have to be changed as well.
      */
-    arg->res.data=xrealloc(arg->res.data,
-                           arg->res.body_start+arg->res.content_len);
+    if(arg->res.body_start+arg->res.content_len > arg->res.buffer_len)
+    {
+      arg->res.buffer_len = arg->res.body_start+arg->res.content_len;
+      arg->res.data=xrealloc(arg->res.data, arg->res.buffer_len);
+    }
     while( arg->res.data_len < arg->res.body_start+arg->res.content_len)
     {
       while(((nr = fd_read(arg->fd, arg->res.data+arg->res.data_len,
@@ -259,17 +266,11 @@ static int parse(struct args *arg)
 			      arg->res.host, arg->res.host_len,
 			      arg->cache,0, NULL, NULL)) && ce->data)
 	{
-	  ptrdiff_t len = WRITE(arg->fd, ce->data->str, ce->data->len);
-	  LOG(len, arg, atoi(ce->data->str+MINIMUM(ce->data->len, 9)));
-	  simple_aap_free_cache_entry( arg->cache, ce );
-	  /* if keepalive... */
-	  if((arg->res.protocol==s_http_11)
-	     ||aap_get_header(arg, "connection", H_EXISTS, 0))
-	  {
-	    return -1;
-	  }
-          DWERROR("Closing connection...\n");
-          free_args( arg );
+	  /* Sent by the same threads as other replies, so that a slow
+	   * client doesn't hold up the thread that reads requests. It
+	   * also takes care of keep-alive.
+	   */
+	  aap_send_cached(arg, ce);
 	  return 0;
 	}
     }
@@ -277,108 +278,97 @@ static int parse(struct args *arg)
   return 1;
 }
 
-void aap_handle_connection(struct args *arg)
+/* Prepares the buffer of the connection for the next request, moving
+ * any leftovers from the previous request to the start of it.
+ */
+static int begin_request(struct args *arg)
 {
-  char *buffer, *p, *tmp;
-  ptrdiff_t pos, buffer_len;
-#ifdef HAVE_TIMEOUTS
-  int *timeout = NULL;
-#endif
- start:
-  pos=0;
-  buffer_len=8192;
-
-  if(arg->res.data && arg->res.data_len > 0)
-  {
-    p = buffer = arg->res.data;
-    buffer_len = MAXIMUM(arg->res.data_len,8192);
-    arg->res.data=0;
-  }
-  else
-    p = buffer = malloc(8192);
-
-  if(!buffer)
+  if(!arg->res.data)
   {
-    perror("AAP: Failed to allocate buffer (leftovers)");
-    failed(arg);
-    return;
+    if(!(arg->res.data = malloc(8192)))
+    {
+      perror("AAP: Failed to allocate buffer");
+      return 0;
+    }
+    arg->res.buffer_len = 8192;
   }
 
   if(arg->res.leftovers && arg->res.leftovers_len)
   {
-    buffer_len = arg->res.leftovers_len;
-    memcpy(buffer, arg->res.leftovers, arg->res.leftovers_len);
-    pos = arg->res.leftovers_len;
-    arg->res.leftovers=0;
-    if((tmp = my_memmem("\r\n\r\n", 4, buffer, pos)))
-      goto ok;
-    p += arg->res.leftovers_len;
+    memmove(arg->res.data, arg->res.leftovers, arg->res.leftovers_len);
+    arg->res.data_len = arg->res.leftovers_len;
   }
+  else
+    arg->res.data_len = 0;
+  arg->res.leftovers = 0;
+  arg->res.leftovers_len = 0;
+  return 1;
+}
 
-#ifdef HAVE_TIMEOUTS
-  if( arg->timeout )
-    timeout = aap_add_timeout_thr(th_self(), arg->timeout);
-  while( !timeout  || !(*timeout) )
-#else
-  while(1)
-#endif /* HAVE_TIMEOUTS */
+/* Looks for the end of the request header, taking into account that
+ * only the last new_bytes bytes of the buffer are new.
+ */
+static int header_complete(struct args *arg, ptrdiff_t new_bytes)
+{
+  char *tmp;
+  ptrdiff_t from = MAXIMUM(arg->res.data_len - new_bytes - 3, 0);
+  if(arg->res.data_len - from < 4)
+    return 0;
+  if((tmp = my_memmem("\r\n\r\n", 4, arg->res.data + from,
+		      arg->res.data_len - from)))
   {
-    ptrdiff_t data_read = fd_read(arg->fd, p, buffer_len-pos);
-    if(data_read <= 0)
-    {
-      DWERROR("AAP: Read error/eof.\n");
-      arg->res.data = buffer;
-      free_args( arg );
-#ifdef HAVE_TIMEOUTS
-      if( timeout )
-      {
-        aap_remove_timeout_thr( timeout );
-        timeout=NULL;
-      }
-#endif
-      return;
-    }
-    pos += data_read;
-    if((tmp = my_memmem("\r\n\r\n", 4, MAXIMUM(p-3, buffer),
-			data_read+(p-3>buffer?3:0))))
-      goto ok;
-    p += data_read;
-    if(pos >= buffer_len)
-    {
-      buffer_len *= 2;
-      if(buffer_len > MAXLEN)
-	break;
-
-      buffer = xrealloc(buffer, buffer_len);
-      p = buffer+pos;
-    }
+    arg->res.body_start = (tmp+4)-arg->res.data;
+    return 1;
   }
+  return 0;
+}
 
-  arg->res.data = buffer;
-  failed( arg );
-#ifdef HAVE_TIMEOUTS
-  if( timeout )
+#define READ_EOF	-1
+#define READ_TOO_LONG	-2
+
+/* Reads once from the connection. Returns 1 when the request header
+ * is complete, 0 if more data is needed, and READ_EOF or
+ * READ_TOO_LONG on failure.
+ */
+static int read_request(struct args *arg)
+{
+  ptrdiff_t nr;
+  if(arg->res.data_len >= arg->res.buffer_len)
   {
-    aap_remove_timeout_thr( timeout );
-    timeout=NULL;
+    if(arg->res.buffer_len*2 > MAXLEN)
+      return READ_TOO_LONG;
+    arg->res.buffer_len *= 2;
+    arg->res.data = xrealloc(arg->res.data, arg->res.buffer_len);
   }
-#endif
-  return;
-
- ok:
-#ifdef HAVE_TIMEOUTS
-  if (timeout)
+  nr = fd_read(arg->fd, arg->res.data + arg->res.data_len,
+	       arg->res.buffer_len - arg->res.data_len);
+  if(nr < 0 && errno == EINTR)
+    return 0;
+  if(nr <= 0)
   {
-    aap_remove_timeout_thr( timeout );
-    timeout=NULL;
+    DWERROR("AAP: Read error/eof.\n");
+    return READ_EOF;
   }
-#endif /* HAVE_TIMEOUTS */
-  arg->res.body_start = (tmp+4)-buffer;
-  arg->res.data = buffer;
-  arg->res.data_len = pos;
-  switch(parse(arg))
+  arg->res.data_len += nr;
+  return header_complete(arg, nr);
+}
+
+static void read_failed(struct args *arg, int res)
+{
+  if(res == READ_EOF)
+    free_args( arg );
+  else
+    failed( arg );
+}
+
+/* Handles a request whose header has been received. The connection
+ * is then owned by the reply, which continues with the next request
+ * on it if it is kept alive.
+ */
+static void handle_request(struct args *arg)
+{
+  if(parse(arg))
   {
-   case 1:
     mt_lock(&queue_mutex);
     if(!request)
     {
@@ -393,15 +383,232 @@ void aap_handle_connection(struct args *arg)
     }
     mt_unlock(&queue_mutex);
     wake_up_backend();
+  }
+}
+
+#ifdef AAP_USE_EPOLL
+struct aap_worker
+{
+  int epfd;
+  THREAD_T thr;
+  /* Connections registered with epfd, for the timeouts. */
+  PIKE_MUTEX_T idle_lock;
+  struct args *idle;
+};
+
+static struct aap_worker aap_workers[AAP_WORKERS];
+static int aap_workers_started;
+static unsigned int aap_next_worker;
+
+static void process_requests(struct args *arg);
+
+/* Must have the idle lock. */
+static void unlink_idle(struct aap_worker *w, struct args *arg)
+{
+  if(arg->idle_prev)
+    arg->idle_prev->idle_next = arg->idle_next;
+  else
+    w->idle = arg->idle_next;
+  if(arg->idle_next)
+    arg->idle_next->idle_prev = arg->idle_prev;
+  arg->idle_prev = arg->idle_next = NULL;
+}
+
+/* Lets the epoll loop of the worker of the connection wait for more
+ * data. The connection is then handled by that thread.
+ */
+static void wait_for_data(struct args *arg)
+{
+  struct aap_worker *w = arg->worker;
+  struct epoll_event ev;
+  int op;
+
+  if(!w)
+    w = arg->worker = aap_workers + (aap_next_worker++ % AAP_WORKERS);
+
+  mt_lock(&w->idle_lock);
+  arg->idle_since = time(0);
+  arg->idle_prev = NULL;
+  arg->idle_next = w->idle;
+  if(w->idle)
+    w->idle->idle_prev = arg;
+  w->idle = arg;
+  mt_unlock(&w->idle_lock);
+
+  /* NB: The worker may be done with arg as soon as epoll_ctl() has
+   *     been called. */
+  op = arg->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  arg->registered = 1;
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = arg;
+  if(epoll_ctl(w->epfd, op, arg->fd, &ev) < 0)
+  {
+    perror("AAP: epoll_ctl");
+    mt_lock(&w->idle_lock);
+    unlink_idle(w, arg);
+    mt_unlock(&w->idle_lock);
+    free_args( arg );
+  }
+}
+
+/* Returns true if the body of the request hasn't been received yet.
+ * Reading the body is left to parse(), in a thread of its own.
+ */
+static int body_pending(struct args *arg)
+{
+  int content_len = 0;
+  char *eol = memchr(arg->res.data, '\n', arg->res.body_start);
+  arg->res.header_start = eol ? (eol+1)-arg->res.data : 0;
+  aap_get_header(arg, "content-length", H_INT, &content_len);
+  return (arg->res.data_len - arg->res.body_start) < content_len;
+}
+
+/* Handles a request that has been received. Any pipelined requests
+ * after it are handled when it has been answered.
+ */
+static void process_requests(struct args *arg)
+{
+  if(body_pending(arg))
+    th_farm((void (*)(void *))handle_request, arg);
+  else
+    handle_request(arg);
+}
+
+static void expire_idle(struct aap_worker *w)
+{
+  struct args *arg, *next;
+  int now = time(0);
+  mt_lock(&w->idle_lock);
+  for(arg = w->idle; arg; arg = next)
+  {
+    next = arg->idle_next;
+    if(arg->timeout && (arg->idle_since + arg->timeout < now))
+    {
+      DWERROR("AAP: Idle timeout.\n");
+      unlink_idle(w, arg);
+      epoll_ctl(w->epfd, EPOLL_CTL_DEL, arg->fd, NULL);
+      free_args( arg );
+    }
+  }
+  mt_unlock(&w->idle_lock);
+}
+
+static void *worker_loop(void *p)
+{
+  struct aap_worker *w = p;
+  struct epoll_event events[64];
+  while(1)
+  {
+    int i, n = epoll_wait(w->epfd, events, 64, 1000);
+    for(i=0; i<n; i++)
+    {
+      struct args *arg = events[i].data.ptr;
+      int res;
+      mt_lock(&w->idle_lock);
+      unlink_idle(w, arg);
+      mt_unlock(&w->idle_lock);
+
+      /* NB: Only one read, since the socket is in blocking mode. */
+      res = read_request(arg);
+      if(!res)
+	wait_for_data(arg);
+      else if(res < 0)
+	read_failed(arg, res);
+      else
+	process_requests(arg);
+    }
+    if(n < 0 && errno != EINTR)
+    {
+      perror("AAP: epoll_wait");
+      break;
+    }
+    expire_idle(w);
+  }
+  return NULL;
+}
+
+static void start_workers(void)
+{
+  int i;
+  if(aap_workers_started)
     return;
+  for(i=0; i<AAP_WORKERS; i++)
+  {
+    if((aap_workers[i].epfd = epoll_create(1024)) < 0)
+    {
+      int e = errno;
+      while(i--)
+	fd_close(aap_workers[i].epfd);
+      Pike_error("Failed to create epoll set: %s\n", strerror(e));
+    }
+  }
+  for(i=0; i<AAP_WORKERS; i++)
+  {
+    mt_init(&aap_workers[i].idle_lock);
+    th_create_small(&aap_workers[i].thr, worker_loop, aap_workers+i);
+  }
+  aap_workers_started = 1;
+}
 
-   case -1:
-     goto start;
+/* Called for new connections, and when a request has been answered.
+ * Handles any pipelined requests, then leaves the connection to the
+ * epoll loop of a worker thread.
+ */
+void aap_handle_connection(struct args *arg)
+{
+  if(!begin_request(arg))
+  {
+    failed( arg );
+    return;
+  }
+  if(header_complete(arg, arg->res.data_len))
+    process_requests(arg);
+  else
+    wait_for_data(arg);
+}
 
-   case 0:
-    ;
+#else /* !AAP_USE_EPOLL */
+
+void aap_handle_connection(struct args *arg)
+{
+  int res;
+#ifdef HAVE_TIMEOUTS
+  int *timeout = NULL;
+#endif
+  if(!begin_request(arg))
+  {
+    failed( arg );
+    return;
   }
+  res = header_complete(arg, arg->res.data_len);
+
+#ifdef HAVE_TIMEOUTS
+  if( !res && arg->timeout )
+    timeout = aap_add_timeout_thr(th_self(), arg->timeout);
+  while( !res && (!timeout || !(*timeout)) )
+#else
+  while( !res )
+#endif /* HAVE_TIMEOUTS */
+    res = read_request(arg);
+
+#ifdef HAVE_TIMEOUTS
+  if( timeout )
+  {
+    aap_remove_timeout_thr( timeout );
+    timeout=NULL;
+  }
+#endif
+
+  if(res <= 0)
+  {
+    /* NB: Timeouts are reported as failed requests. */
+    read_failed(arg, res);
+    return;
+  }
+
+  handle_request(arg);
 }
+#endif /* AAP_USE_EPOLL */
 
 #ifndef HAVE_AND_USE_POLL
 #undef HAVE_POLL
@@ -435,7 +642,12 @@ static void low_accept_loop(struct args *arg)
     arg2->fd = fd_accept(arg->fd, (struct sockaddr *)&arg2->from, &len);
     if(arg2->fd != -1)
     {
+#ifdef AAP_USE_EPOLL
+      /* Normally just adds the connection to an epoll loop. */
+      aap_handle_connection(arg2);
+#else
       th_farm((void (*)(void *))aap_handle_connection, arg2);
+#endif
       arg2 = new_args();
       arg2->res.leftovers = 0;
     } else {
@@ -542,10 +754,17 @@ static void finished_p(struct callback *UNUSED(foo), void *UNUSED(b), void *UNUS
  *! @[program] class (which has to inherit @[RequestProgram] to the
  *! @[request_handler] callback function.
  *!
- *! @[cache_size] is the maximum size of the cache, in bytes.
+ *! @[cache_size] is the maximum size of the cache, in bytes. When the
+ *! cache grows larger than this, the least recently used entries are
+ *! removed.
  *! @[keep_log] indicates if a log of all requests should be kept.
  *! @[timeout] if non-zero indicates a maximum time the server will wait for requests.
  *!
+ *! @note
+ *!   On systems with epoll(7), keep-alive connections that are
+ *!   waiting for the next request are handled by a small fixed set
+ *!   of worker threads, so that idle connections don't occupy a
+ *!   thread each. Pipelined requests are handled in order.
 */
 static void f_accept_with_http_parse(INT32 nargs)
 {
@@ -601,6 +820,10 @@ static void f_accept_with_http_parse(INT32 nargs)
   if(!my_callback)
     my_callback = add_backend_callback( finished_p, 0, 0 );
 
+#ifdef AAP_USE_EPOLL
+  start_workers();
+#endif
+
   {
     int i;
     for( i = 0; i<8; i++ )
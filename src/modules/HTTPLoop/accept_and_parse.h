@@ -11,6 +11,15 @@
 #define HAVE_TIMEOUTS
 #endif
 
+/* Connections waiting for a request are handled by a fixed set of
+ * worker threads, each with an epoll loop of its own, instead of
+ * occupying one thread each in a blocking read. */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE) && \
+  defined(HAVE_TIMEOUTS)
+#define AAP_USE_EPOLL
+#define AAP_WORKERS 4
+#endif
+
 struct res
 {
   struct pike_string *protocol;
@@ -33,11 +42,15 @@ struct res
 
   char *data;
   ptrdiff_t data_len;
+  ptrdiff_t buffer_len;
 };
 
 struct cache_entry
 {
   struct cache_entry *next;
+  /* Least recently used list, most recently used first. */
+  struct cache_entry *lru_prev, *lru_next;
+  size_t hv;
   struct pike_string *data;
   time_t stale_at;
   char *url;
@@ -79,6 +92,7 @@ struct cache
   PIKE_MUTEX_T mutex;
   struct cache *next;
   struct cache_entry *htable[CACHE_HTABLE_SIZE];
+  struct cache_entry *lru_head, *lru_tail;
   UINT64 size, entries, max_size;
   UINT64 hits, misses, stale;
   size_t num_requests, sent_data, received_data;
@@ -98,6 +112,13 @@ struct args
   struct cache *cache;
   struct filesystem *filesystem;
   struct log *log;
+#ifdef AAP_USE_EPOLL
+  struct aap_worker *worker;
+  /* The idle list of the worker, for timeouts. */
+  struct args *idle_prev, *idle_next;
+  int idle_since;
+  int registered;
+#endif
 };
 
 struct log_entry
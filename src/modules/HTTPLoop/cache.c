@@ -35,38 +35,45 @@ static struct pike_string *free_queue[1024];
 static int numtofree;
 static PIKE_MUTEX_T tofree_mutex;
 
-static PIKE_MUTEX_T cache_entry_lock;
-int next_free_ce, num_cache_entries;
-struct cache_entry *free_cache_entries[1024];
-
 static void low_free_cache_entry( struct cache_entry *arg )
 {
-  num_cache_entries--;
-
   aap_enqueue_string_to_free( arg->data );
   free( arg->url ); /* host is in the same malloced area */
+  free( arg );
+}
+
+/* NB: The entries used to be kept in a global mutex protected free
+ *     list, which all threads contended for. malloc(3) caches small
+ *     blocks per thread anyway. */
+struct cache_entry *new_cache_entry( )
+{
+  return malloc( sizeof( struct cache_entry ) );
+}
 
-  mt_lock( &cache_entry_lock );
-  if( next_free_ce < 1024 )
-    free_cache_entries[next_free_ce++] = arg;
+/* Must have the cache lock. */
+static void lru_unlink(struct cache *c, struct cache_entry *e)
+{
+  if(e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    c->lru_head = e->lru_next;
+  if(e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
   else
-    free(arg);
-  mt_unlock( &cache_entry_lock );
-/*   fprintf(stderr, " %d+%d args\n", num_cache_entries, next_free_ce ); */
+    c->lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
 }
 
-struct cache_entry *new_cache_entry( )
+/* Must have the cache lock. */
+static void lru_push(struct cache *c, struct cache_entry *e)
 {
-  struct cache_entry *res;
-  mt_lock( &cache_entry_lock );
-  num_cache_entries++;
-  if( next_free_ce )
-    res = free_cache_entries[--next_free_ce];
+  e->lru_prev = NULL;
+  e->lru_next = c->lru_head;
+  if(c->lru_head)
+    c->lru_head->lru_prev = e;
   else
-    res = malloc( sizeof( struct cache_entry ) );
-  mt_unlock( &cache_entry_lock );
-/*   fprintf(stderr, " %d+%d centries\n", num_cache_entries, next_free_ce ); */
-  return res;
+    c->lru_tail = e;
+  c->lru_head = e;
 }
 
 static void really_free_from_queue(void)
@@ -157,6 +164,7 @@ static void really_free_cache_entry(struct cache  *c, struct cache_entry *e,
     c->htable[ b ] = e->next;
   else
     prev->next = e->next;
+  lru_unlink(c, e);
 
   c->size -= e->data->len;
   c->entries--;
@@ -200,6 +208,30 @@ void simple_aap_free_cache_entry(struct cache *c, struct cache_entry *e)
 }
 
 
+/* Removes the least recently used entries until the cache is below
+ * target bytes. Entries that are being sent are only unlinked when
+ * the last reference is gone. Must have the cache lock. */
+static void cache_evict(struct cache *c, UINT64 target)
+{
+  struct cache_entry *e = c->lru_tail;
+  while(e && c->size > target)
+  {
+    struct cache_entry *prev_lru = e->lru_prev;
+    if(e->refs == 1)
+    {
+      struct cache_entry *t = c->htable[e->hv], *p = NULL;
+      while(t && t != e)
+      {
+	p = t;
+	t = t->next;
+      }
+      if(t)
+	aap_free_cache_entry(c, e, p, e->hv);
+    }
+    e = prev_lru;
+  }
+}
+
 void aap_cache_insert(struct cache_entry *ce, struct cache *c)
 {
   struct cache_entry *head, *p;
@@ -227,9 +259,13 @@ void aap_cache_insert(struct cache_entry *ce, struct cache *c)
     memcpy(t,ce->url,ce->url_len);   ce->url = t;   t+=ce->url_len;
     memcpy(t,ce->host,ce->host_len); ce->host = t;
     ce->next = c->htable[hv];
+    ce->hv = hv;
     ce->refs = 1;
     c->htable[hv] = ce;
+    lru_push(c, ce);
   }
+  if(c->size > c->max_size)
+    cache_evict(c, c->max_size - c->max_size/8);
 }
 
 struct cache_entry *aap_cache_lookup(char *s, ptrdiff_t len,
@@ -267,15 +303,20 @@ struct cache_entry *aap_cache_lookup(char *s, ptrdiff_t len,
 	return 0;
       }
       c->hits++;
-      /* cache hit. Lets add it to the top of the list */
+      /* cache hit. Lets add it to the top of the lists */
       if(c->htable[h] != e)
       {
 	if(prev) prev->next = e->next;
 	e->next = c->htable[h];
 	c->htable[h] = e;
       }
-      if(!nolock) mt_unlock(&c->mutex);
+      if(c->lru_head != e)
+      {
+	lru_unlink(c, e);
+	lru_push(c, e);
+      }
       e->refs++;
+      if(!nolock) mt_unlock(&c->mutex);
       return e;
     }
     prev = e;
@@ -296,6 +337,5 @@ void aap_clean_cache(void)
 void aap_init_cache(void)
 {
   mt_init(&tofree_mutex);
-  mt_init(&cache_entry_lock);
 }
 #endif
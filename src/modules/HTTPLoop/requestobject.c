@@ -34,6 +34,12 @@
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
 #endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 
 #define sp Pike_sp
@@ -55,10 +61,14 @@
 #define DWERROR(...)
 #endif
 
-/* All current implementations of sendfile(2) are broken. */
+/* The FreeBSD sendfile(2) has been found to be broken, and the
+ * Linux one is only used with a proper prototype.
+ */
+#if defined(HAVE_FREEBSD_SENDFILE) || !defined(HAVE_SYS_SENDFILE_H)
 #ifndef HAVE_BROKEN_SENDFILE
 #define HAVE_BROKEN_SENDFILE
 #endif /* !HAVE_BROKEN_SENDFILE */
+#endif /* HAVE_FREEBSD_SENDFILE || !HAVE_SYS_SENDFILE_H */
 
 #ifdef HAVE_BROKEN_SENDFILE
 #ifdef HAVE_SENDFILE
@@ -515,6 +525,9 @@ struct send_args
   struct pike_string *data;
   ptrdiff_t len;
   ptrdiff_t sent;
+  /* For cached replies, the cache entry that data belongs to. */
+  struct cache *cache;
+  struct cache_entry *ce;
   char buffer[BUFFER];
 };
 
@@ -528,7 +541,8 @@ static struct send_args *new_send_args(void)
 static void free_send_args(struct send_args *s)
 {
   num_send_args--;
-  if( s->data )    aap_enqueue_string_to_free( s->data );
+  if( s->ce )        simple_aap_free_cache_entry( s->cache, s->ce );
+  else if( s->data ) aap_enqueue_string_to_free( s->data );
   if( s->from_fd ) fd_close( s->from_fd );
   free( s );
 }
@@ -666,28 +680,53 @@ static void actually_send(struct send_args *a)
   fail = 0;
 
 #if !defined(HAVE_FREEBSD_SENDFILE) && defined(HAVE_SENDFILE)
-  if(a->len)
+  /* NB: A negative length means until eof, which isn't supported by
+   *     sendfile(2). */
+  if(a->len > 0)
   {
+    int sent_any = 0;
     DWERROR("pre sendfile... \n");
     if(!first)
     {
+      /* NB: This doesn't count for sent_any, as the fallback below
+       *     continues from the current position of the file. */
       first=1;
       fail = fd_read(a->from_fd, foo, 10);
-      if(fail < 0)
+      if(fail <= 0)
+        goto end;
+      if(WRITE( a->to->fd, foo, fail ) != fail)
         goto end;
-      WRITE( a->to->fd, foo, fail );
       a->len -= fail;
+      a->sent += fail;
     }
     DWERROR("sendfile... \n");
-    switch(fail = sendfile(a->to->fd, a->from_fd, NULL, a->len ))
+    fail = 0;
+    while(a->len > 0)
     {
-     case -ENOSYS:
-       DWERROR("syscall does not exist.\n");
-       goto normal;
-     default:
-       if(fail != a->len)
-         fprintf(stderr, "sendfile returned %ld; len=%ld\n",
-                 (long)fail, (long)a->len);
+      ptrdiff_t res = sendfile(a->to->fd, a->from_fd, NULL,
+                               MINIMUM(a->len, 0x7fff0000));
+      if(res < 0)
+      {
+        if(errno == EINTR || errno == EAGAIN)
+          continue;
+        if(!sent_any && (errno == EINVAL || errno == ENOSYS))
+        {
+          /* Not a regular file, or not supported by the kernel. */
+          DWERROR("sendfile failed, falling back.\n");
+          goto normal;
+        }
+        fail = 1;
+        break;
+      }
+      if(!res)
+      {
+        /* The file was shorter than expected. */
+        fail = 1;
+        break;
+      }
+      sent_any = 1;
+      a->len -= res;
+      a->sent += res;
     }
     goto end;
   }
@@ -754,9 +793,7 @@ static void actually_send(struct send_args *a)
     LOG(a->sent, a->to, atoi(foo));
     free_send_args( a );
 
-    if(!fail &&
-       ((arg->res.protocol==s_http_11)||
-        aap_get_header(arg, "connection", H_EXISTS, 0)))
+    if(!fail && aap_keep_alive(arg))
     {
       aap_handle_connection(arg);
     }
@@ -819,6 +856,8 @@ void f_aap_reply(INT32 args)
     q->data = 0;
   }
   q->sent = 0;
+  q->cache = NULL;
+  q->ce = NULL;
 
   th_farm( (void (*)(void *))actually_send, (void *)q );
 
@@ -826,11 +865,30 @@ void f_aap_reply(INT32 args)
   push_int(0);
 }
 
+/* Sends the cached reply ce on the connection in a thread of its own,
+ * like replies from pike code. The reference to ce from
+ * aap_cache_lookup() is released when it has been sent.
+ *
+ * NB: Runs without the interpreter lock.
+ */
+void aap_send_cached(struct args *arg, struct cache_entry *ce)
+{
+  struct send_args *q = new_send_args();
+  q->to = arg;
+  q->from_fd = 0;
+  q->len = 0;
+  q->sent = 0;
+  q->data = ce->data;
+  q->cache = arg->cache;
+  q->ce = ce;
+  th_farm( (void (*)(void *))actually_send, (void *)q );
+}
+
 void f_aap_reply_with_cache(INT32 args)
 {
   struct cache_entry *ce;
   struct pike_string *reply;
-  INT_TYPE time_to_keep, t, freed=0;
+  INT_TYPE time_to_keep, t;
   if(!THIS->request)
     Pike_error("Reply already called.\n");
 
@@ -849,33 +907,8 @@ void f_aap_reply_with_cache(INT32 args)
     THREADS_ALLOW();
     t = aap_get_time();
     mt_lock(&rc->mutex);
-    if(rc->size > rc->max_size)
-    {
-      struct cache_entry *p,*pp=0,*ppp=0;
-      ptrdiff_t target = rc->max_size - rc->max_size/3;
-      while((size_t)rc->size > (size_t)target)
-      {
-	int i;
-	freed=0;
-	for(i = 0; i<CACHE_HTABLE_SIZE; i++)
-	{
-	  p = rc->htable[i];
-	  ppp=pp=0;
-	  while(p)
-	  {
-	    ppp = pp;
-	    pp = p;
-	    p = p->next;
-	  }
-	  if(pp) aap_free_cache_entry(rc,pp,ppp,i);
-	  freed++;
-	  if((size_t)rc->size < (size_t)target)
-	    break;
-	}
-	if(!freed)  /* no way.. */
-	  break;
-      }
-    }
+    /* NB: aap_cache_insert() evicts the least recently used entries
+     *     if the cache grows above max_size. */
     ce = new_cache_entry();
     memset(ce, 0, sizeof(struct cache_entry));
     ce->stale_at = t+time_to_keep;
@@ -10,6 +10,7 @@ void f_aap_end(INT32 args);
 void f_aap_output(INT32 args);
 void f_aap_reply(INT32 args);
 void f_aap_reply_with_cache(INT32 args);
+void aap_send_cached(struct args *arg, struct cache_entry *ce);
 void f_low_aap_reqo__init(struct c_request_object *);
 void aap_init_request_object(struct object *o);
 void aap_exit_request_object(struct object *o);
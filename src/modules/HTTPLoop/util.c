@@ -10,6 +10,7 @@
 
 #include <threads.h>
 #include <fdlib.h>
+#include <stralloc.h>
 
 #ifdef _REENTRANT
 #include <errno.h>
@@ -27,6 +28,10 @@
 #include "accept_and_parse.h"
 #include "util.h"
 
+#define STRING(X,Y) extern struct pike_string *X
+#include "static_strings.h"
+#undef STRING
+
 
 int aap_get_time(void)
 {
@@ -112,4 +117,28 @@ int aap_get_header(struct args *req, char *header, int operation, void *res)
   }
   return 0;
 }
+/* Returns true if the connection should be kept open after the
+ * request: HTTP/1.1 unless "Connection: close", or an explicit
+ * "Connection: keep-alive".
+ */
+int aap_keep_alive(struct args *req)
+{
+  struct pstring h;
+  if(aap_get_header(req, "connection", H_STRING, &h))
+  {
+    ptrdiff_t i;
+    char *s = h.str;
+    for(i=0; i<h.len; i++)
+    {
+      /* Inlined strncasecmp(s+i, "close", 5) etc. */
+      if(h.len-i >= 5 && (s[i]|32) == 'c' && (s[i+1]|32) == 'l' &&
+	 (s[i+2]|32) == 'o' && (s[i+3]|32) == 's' && (s[i+4]|32) == 'e')
+	return 0;
+      if(h.len-i >= 10 && (s[i]|32) == 'k' && (s[i+1]|32) == 'e' &&
+	 (s[i+2]|32) == 'e' && (s[i+3]|32) == 'p' && s[i+4] == '-')
+	return 1;
+    }
+  }
+  return req->res.protocol == s_http_11;
+}
 #endif
@@ -13,3 +13,4 @@ ptrdiff_t aap_swrite(int to, char *buf, size_t towrite);
 
 
 int aap_get_header(struct args *req, char *header, int operation, void *res);
+int aap_keep_alive(struct args *req);
@@ -22,8 +22,13 @@
 #include "stralloc.h"
 #include "program_id.h"
 #include "block_allocator.h"
+#include "bitvector.h"
 #include <ctype.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "parser.h"
 
 
@@ -348,6 +353,11 @@ struct parser_html_storage
    /* resulting data */
    struct out_piece *out,*out_end;
 
+   /* String output that logically follows the out pieces. When not in
+    * mixed mode, data is collected here to avoid a substring and an
+    * out piece for every stretch of data between tags. */
+   struct string_builder out_buf;
+
    /* Upper bound for the string shift in the output queue. -1 when in
     * mixed mode. */
    int out_max_shift;
@@ -544,6 +554,7 @@ static void reset_feed(struct parser_html_storage *this)
       this->out=f->next;
       really_free_out_piece (f);
    }
+   reset_string_builder (&this->out_buf);
    if (this->out_max_shift > 0) this->out_max_shift = 0;
    this->out_length = 0;
    this->out_ctx = CTX_DATA;
@@ -753,6 +764,7 @@ static void init_html_struct(struct object *UNUSED(o))
    /* initialize feed */
    THIS->data_cb_feed = NULL;
    THIS->out=NULL;
+   init_string_builder (&THIS->out_buf, 0);
    THIS->out_length = THIS->out_max_shift = 0;
    THIS->stack = &THIS->top;
    THIS->top.prev = NULL;
@@ -787,6 +799,7 @@ static void exit_html_struct(struct object *UNUSED(o))
    DEBUG((stderr,"exit_html_struct %p\n",THIS));
 
    reset_feed(THIS);
+   free_string_builder (&THIS->out_buf);
 
 #ifdef CONFIGURABLE_MARKUP
    if (THIS->lazy_entity_ends) free(THIS->lazy_entity_ends);
@@ -1389,15 +1402,18 @@ static inline void recheck_scan(struct parser_html_storage *this,
 /* -------------- */
 /* feed to output */
 
-static void put_out_feed(struct parser_html_storage *this, struct svalue *v)
+/* Strings at least this long are queued by reference rather than
+ * copied into out_buf. */
+#define OUT_BUF_DIRECT	4096
+
+/* out_buf keeps its allocation between reads up to this size. */
+#define OUT_BUF_KEEP	65536
+
+static void append_out_piece(struct parser_html_storage *this,
+			     struct svalue *v)
 {
    struct out_piece *f;
 
-#ifdef PIKE_DEBUG
-   if (TYPEOF(*v) != T_STRING && this->out_max_shift >= 0)
-     Pike_fatal ("Putting a non-string into output queue in non-mixed mode.\n");
-#endif
-
    f = alloc_out_piece();
    assign_svalue_no_free(&f->v,v);
 
@@ -1410,13 +1426,70 @@ static void put_out_feed(struct parser_html_storage *this, struct svalue *v)
      this->out_end->next=f;
      this->out_end=f;
    }
+}
 
-   if (this->out_max_shift >= 0) {
-     this->out_max_shift = MAXIMUM (this->out_max_shift, v->u.string->size_shift);
-     this->out_length += v->u.string->len;
+/* Returns the contents of out_buf as a string and empties it. */
+static struct pike_string *take_out_buf(struct parser_html_storage *this)
+{
+   struct pike_string *s;
+
+   if (this->out_buf.malloced > OUT_BUF_KEEP) {
+      s = finish_string_builder (&this->out_buf);
+      init_string_builder (&this->out_buf, 0);
+   }
+   else {
+      s = make_shared_binary_pcharp (MKPCHARP_STR (this->out_buf.s),
+				     this->out_buf.s->len);
+      reset_string_builder (&this->out_buf);
+   }
+   return s;
+}
+
+/* Moves the contents of out_buf to the end of the output queue. */
+static void flush_out_buf(struct parser_html_storage *this)
+{
+   if (!this->out_buf.s->len) return;
+   push_string (take_out_buf (this));
+   append_out_piece (this, sp-1);
+   pop_stack();
+}
+
+/* Adds len characters from s at start to the output, in string mode. */
+static void put_out_string(struct parser_html_storage *this,
+			   struct pike_string *s,
+			   ptrdiff_t start,
+			   ptrdiff_t len)
+{
+   if (!len) return;
+
+   if (len >= OUT_BUF_DIRECT && len == s->len) {
+      flush_out_buf (this);
+      ref_push_string (s);
+      append_out_piece (this, sp-1);
+      pop_stack();
    }
    else
-     this->out_length++;
+      string_builder_append (&this->out_buf,
+			     ADD_PCHARP (MKPCHARP_STR (s), start), len);
+
+   this->out_max_shift = MAXIMUM (this->out_max_shift, s->size_shift);
+   this->out_length += len;
+}
+
+static void put_out_feed(struct parser_html_storage *this, struct svalue *v)
+{
+#ifdef PIKE_DEBUG
+   if (TYPEOF(*v) != T_STRING && this->out_max_shift >= 0)
+     Pike_fatal ("Putting a non-string into output queue in non-mixed mode.\n");
+#endif
+
+   if (this->out_max_shift >= 0) {
+     put_out_string (this, v->u.string, 0, v->u.string->len);
+     return;
+   }
+
+   append_out_piece (this, v);
+   this->out_length++;
 }
 
 /* ---------------------------- */
@@ -1434,6 +1507,23 @@ static void put_out_feed_range(struct parser_html_storage *this,
    /* fit it in range (this allows other code to ignore eof stuff) */
    if (c_tail>tail->s->len) c_tail=tail->s->len;
 
+   if (this->out_max_shift >= 0) {
+     /* Copy the data directly to out_buf, without substrings. */
+     while (head != tail)
+     {
+#ifdef PIKE_DEBUG
+       if (!head)
+	 Pike_fatal("internal error: tail not found in feed (put_out_feed_range)\n");
+#endif
+       put_out_string (this, head->s, c_head, head->s->len - c_head);
+       c_head = 0;
+       head = head->next;
+     }
+     if (c_tail > c_head)
+       put_out_string (this, head->s, c_head, c_tail - c_head);
+     return;
+   }
+
    if (head != tail && c_head) {
      if (head->s->len-c_head)	/* Ignore empty strings. */
      {
@@ -1668,6 +1758,79 @@ static p_wchar2 next_character(struct piece *feed,
 /* ------------------------------ */
 /* scan forward for certain chars */
 
+#ifdef __SSE2__
+/* The SSE2 scan handles at most this many characters to look for. */
+#define SIMD_MAX_LOOK_FOR 8
+
+/* Compares 16 bytes at a time with each character to look for. The
+ * characters are compared as 8, 16 or 32 bit lanes depending on the
+ * shift, and the resulting byte mask is shifted down accordingly. */
+#define SIMD_SCAN(TYPE, SET1, CMPEQ, MAXCHAR) do {			\
+     const TYPE *p = (const TYPE *)s->str;				\
+     __m128i v[SIMD_MAX_LOOK_FOR];					\
+     int k, m = 0;							\
+     for (k = 0; k < num_look_for; k++)				\
+       if ((unsigned INT32)look_for[k] <= (MAXCHAR))			\
+	 v[m++] = SET1 ((TYPE)look_for[k]);				\
+     if (!m) return len;						\
+     for (; i + (ptrdiff_t)(16/sizeof(TYPE)) <= len;			\
+	  i += 16/sizeof(TYPE)) {					\
+       __m128i d = _mm_loadu_si128 ((const __m128i *)(p + i));	\
+       __m128i hit = CMPEQ (d, v[0]);					\
+       int mask;							\
+       for (k = 1; k < m; k++)						\
+	 hit = _mm_or_si128 (hit, CMPEQ (d, v[k]));			\
+       if ((mask = _mm_movemask_epi8 (hit)))				\
+	 return i + ctz32 (mask) / sizeof(TYPE);			\
+     }									\
+   } while (0)
+#endif
+
+/* Returns the position of the first character in s from start that
+ * is one of look_for, or the length of s if there is none. */
+static ptrdiff_t find_first_of(struct pike_string *s,
+			       ptrdiff_t start,
+			       const p_wchar2 *look_for,
+			       ptrdiff_t num_look_for)
+{
+   ptrdiff_t i = start, len = s->len;
+
+   if (num_look_for == 1 && !s->size_shift) {
+      const p_wchar0 *p;
+      if ((unsigned INT32)look_for[0] > 0xff) return len;
+      p = memchr (s->str + i, look_for[0], len - i);
+      return p ? p - STR0(s) : len;
+   }
+
+#ifdef __SSE2__
+   if (num_look_for <= SIMD_MAX_LOOK_FOR)
+      switch (s->size_shift)
+      {
+	 case 0: SIMD_SCAN (p_wchar0, _mm_set1_epi8, _mm_cmpeq_epi8, 0xff); break;
+	 case 1: SIMD_SCAN (p_wchar1, _mm_set1_epi16, _mm_cmpeq_epi16, 0xffff); break;
+	 case 2: SIMD_SCAN (p_wchar2, _mm_set1_epi32, _mm_cmpeq_epi32, 0x7fffffff); break;
+      }
+#endif
+
+   switch (s->size_shift)
+   {
+#define LOOP(TYPE)							\
+      {									\
+	 const TYPE *p = (const TYPE *)s->str;				\
+	 int n;								\
+	 for (; i < len; i++)						\
+	    for (n = 0; n < num_look_for; n++)				\
+	       if ((p_wchar2)p[i] == look_for[n])			\
+		  return i;						\
+      }
+      case 0: LOOP (p_wchar0); break;
+      case 1: LOOP (p_wchar1); break;
+      case 2: LOOP (p_wchar2); break;
+#undef LOOP
+   }
+   return len;
+}
+
 static int scan_forward(struct piece *feed,
 			ptrdiff_t c,
 			struct piece **destp,
@@ -1713,43 +1876,29 @@ static int scan_forward(struct piece *feed,
 			      *destp,*d_p);
 	 return 0; /* not found :-) */
 
-      case 1:
+      default:
 	 if (!rev) {
 	    while (feed)
 	    {
-	       ptrdiff_t ce = feed->s->len - c;
-	       p_wchar2 f=(p_wchar2)*look_for;
-	       SCAN_DEBUG_MARK_SPOT("scan_forward piece loop (1)",feed,c);
-	       switch (feed->s->size_shift)
+	       ptrdiff_t i;
+	       SCAN_DEBUG_MARK_SPOT("scan_forward piece loop",feed,c);
+	       i = find_first_of (feed->s, c, look_for, num_look_for);
+	       if (i < feed->s->len)
 	       {
-#define LOOP(TYPE)							\
-		  {							\
-		     TYPE *s=((TYPE *)feed->s->str)+c;			\
-		     while (ce--)					\
-			if ((p_wchar2)*(s++)==f)			\
-			{						\
-			   c=feed->s->len-ce;				\
-			   goto found;					\
-			}						\
-		  }
-		  case 0: LOOP (p_wchar0); break;
-		  case 1: LOOP (p_wchar1); break;
-		  case 2: LOOP (p_wchar2); break;
-#undef LOOP
-               }
+		  c = i + 1;
+		  goto found;
+	       }
 	       if (!feed->next) break;
 	       c=0;
 	       feed=feed->next;
 	    }
 	    break;
 	 }
-	 /* FALL THROUGH */
 
-      default:  /* num_look_for > 1 */
 	 while (feed)
 	 {
 	    ptrdiff_t ce = feed->s->len - c;
-	    SCAN_DEBUG_MARK_SPOT("scan_forward piece loop (>1)",feed,c);
+	    SCAN_DEBUG_MARK_SPOT("scan_forward piece loop (rev)",feed,c);
 	    switch (feed->s->size_shift)
 	    {
 #define LOOP(TYPE)							\
@@ -1760,11 +1909,12 @@ static int scan_forward(struct piece *feed,
 		  {							\
 		     for (n=0; n<num_look_for; n++)			\
 			if (((p_wchar2)*s)==look_for[n])		\
-			{						\
-			   c=feed->s->len-ce;				\
-			   if (!rev) goto found; else break;		\
-			}						\
-		     if (rev && n==num_look_for) goto found;		\
+			   break;					\
+		     if (n==num_look_for)				\
+		     {							\
+			c=feed->s->len-ce-1;				\
+			goto found;					\
+		     }							\
 		     s++;						\
 		  }							\
 	       }
@@ -4043,6 +4193,15 @@ static void html_read(INT32 args)
    }
    else
    {
+     if (!THIS->out && n == THIS->out_buf.s->len) {
+       /* Everything is in out_buf. */
+       push_string (take_out_buf (THIS));
+       THIS->out_length = 0;
+       THIS->out_max_shift = 0;
+       return;
+     }
+     flush_out_buf (THIS);
+
      /* collect up to n characters */
      if (!THIS->out || THIS->out->v.u.string->len < n) {
        struct string_builder buf;
@@ -4720,6 +4879,7 @@ static void html__inspect(INT32 args)
 
    push_static_text("outfeed");
    p=0;
+   flush_out_buf(THIS);
    of=THIS->out;
    while (of)
    {
@@ -5174,6 +5334,7 @@ static void html_mixed_mode(INT32 args)
        if (!o) {
 	 struct out_piece *f;
 	 size_t c;
+	 flush_out_buf (THIS);
 	 THIS->out_max_shift = -1;
 	 /* Got to count the entries in the output queue. */
 	 for (f = THIS->out, c = 0; f; f = f->next) c++;
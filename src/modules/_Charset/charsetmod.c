@@ -459,7 +459,16 @@ static ptrdiff_t feed_utf8(struct pike_string *str, struct std_cs_stor *s)
   for (; l > 0; l--) {
     unsigned int ch = *p++;
 
-    if (ch & 0x80) {
+    if (!(ch & 0x80)) {
+      /* Copy the whole 7bit run in one go. */
+      ptrdiff_t run = ascii_prefix_length(MKPCHARP(p - 1, 0), l);
+      string_builder_binary_strcat0(&s->strbuild, p - 1, run);
+      p += run - 1;
+      l -= run - 1;
+      continue;
+    }
+
+    {
       int cl = utf8cont[(ch>>1) - 64], i;
       if (!cl)
 	transcoder_error (str, p - STR0(str) - 1, 0, "Invalid byte.\n");
@@ -1739,9 +1748,12 @@ static void feed_utf8e(struct std_cs_stor *cs, struct string_builder *sb,
     {
       p_wchar0 c, *p = STR0(str);
       while(l--)
-	if((c=*p++)<=0x7f)
-	  string_builder_putchar(sb, c);
-        else {
+	if((c=*p++)<=0x7f) {
+	  ptrdiff_t run = ascii_prefix_length(MKPCHARP(p - 1, 0), l + 1);
+	  string_builder_binary_strcat0(sb, p - 1, run);
+	  p += run - 1;
+	  l -= run - 1;
+	} else {
 	  string_builder_putchar(sb, 0xc0|(c>>6));
 	  string_builder_putchar(sb, 0x80|(c&0x3f));
 	}
@@ -1751,9 +1763,12 @@ static void feed_utf8e(struct std_cs_stor *cs, struct string_builder *sb,
     {
       p_wchar1 c, *p = STR1(str);
       while(l--)
-	if((c=*p++)<=0x7f)
-	  string_builder_putchar(sb, c);
-	else if(c<=0x7ff) {
+	if((c=*p++)<=0x7f) {
+	  ptrdiff_t run = ascii_prefix_length(MKPCHARP(p - 1, 1), l + 1);
+	  string_builder_binary_strcat1(sb, p - 1, run);
+	  p += run - 1;
+	  l -= run - 1;
+	} else if(c<=0x7ff) {
 	  string_builder_putchar(sb, 0xc0|(c>>6));
 	  string_builder_putchar(sb, 0x80|(c&0x3f));
 	} else if (c <= 0xd7ff || c >= 0xe000) {
@@ -1769,7 +1784,10 @@ static void feed_utf8e(struct std_cs_stor *cs, struct string_builder *sb,
       p_wchar2 c, *p = STR2(str);
       while(l--) {
 	if((c=*p++)<=0x7f) {
-	  string_builder_putchar(sb, c);
+	  ptrdiff_t run = ascii_prefix_length(MKPCHARP(p - 1, 2), l + 1);
+	  string_builder_binary_strcat2(sb, p - 1, run);
+	  p += run - 1;
+	  l -= run - 1;
 	  continue;
 	}
 	else if(c<=0x7ff) {
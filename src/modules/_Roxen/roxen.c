@@ -30,6 +30,7 @@
 #include "threads.h"
 #include "operators.h"
 #include "bitvector.h"
+#include "modules/_Stdio/buffer.h"
 
 
 /*! @module _Roxen
@@ -332,6 +333,739 @@ static void f_hp_create( INT32 args )
   THP->spc = THP->slash_n = 0;
 }
 
+/*! @endclass
+ */
+
+/*! @class RequestParser
+ *!
+ *! Incremental parser for HTTP/1.x requests operating directly
+ *! on the content of a @[Stdio.Buffer].
+ *!
+ *! The parser consumes exactly one request (header block and body)
+ *! from the buffer at a time, and leaves any following data in the
+ *! buffer, which makes it suitable for pipelined requests.
+ *!
+ *! Both @tt{Content-Length@} and chunked @tt{Transfer-Encoding@}
+ *! are supported. Common header names are returned as shared
+ *! strings that are allocated only once.
+ *!
+ *! @note
+ *!   The buffer must not be modified (other than by adding data)
+ *!   between calls to the parser while a request is being parsed.
+ *!
+ *! @seealso
+ *!   @[HeaderParser]
+ */
+
+#define RP_HEADERS	0	/* Waiting for the header block. */
+#define RP_BODY		1	/* Waiting for a Content-Length body. */
+#define RP_CHUNK_SIZE	2	/* Waiting for a chunk size line. */
+#define RP_CHUNK_DATA	3	/* Reading chunk data. */
+#define RP_CHUNK_CRLF	4	/* Waiting for the CRLF after a chunk. */
+#define RP_TRAILER	5	/* Reading trailer headers. */
+
+/* Max length of a chunk size line (including any extensions). */
+#define RP_MAX_CHUNK_LINE	1024
+
+#define TRP ((struct request_parser *)Pike_fp->current_storage)
+struct request_parser
+{
+  struct mapping *headers;	/* Headers of the current request. */
+  struct string_builder body;	/* Decoded chunked body so far. */
+  INT64 left;			/* Remaining bytes of body or chunk. */
+  INT64 content_length;		/* -1 for chunked. */
+  size_t scan_pos;		/* Header block scanned this far. */
+  size_t max_header_size;
+  INT64 max_body_size;		/* 0 for no limit. */
+  int state;
+  int keep_case;
+  int have_body;		/* The body string_builder is initialized. */
+};
+
+/* Header names that are returned without allocating a new string. */
+static const char *const rp_common_header_names[] = {
+  "accept",
+  "accept-charset",
+  "accept-encoding",
+  "accept-language",
+  "authorization",
+  "cache-control",
+  "connection",
+  "content-length",
+  "content-type",
+  "cookie",
+  "cookie2",
+  "date",
+  "expect",
+  "host",
+  "if-match",
+  "if-modified-since",
+  "if-none-match",
+  "keep-alive",
+  "origin",
+  "pragma",
+  "range",
+  "referer",
+  "te",
+  "transfer-encoding",
+  "upgrade",
+  "user-agent",
+  "x-forwarded-for",
+};
+
+static struct pike_string *
+  rp_common_headers[NELEM(rp_common_header_names)];
+
+/* Framing information extracted while parsing the header block. */
+struct rp_framing
+{
+  INT64 content_length;
+  int content_length_seen;
+  int transfer_encoding;	/* A Transfer-Encoding header was seen. */
+  int chunked;			/* The final transfer coding is chunked. */
+};
+
+static int rp_lower(int c)
+{
+  if ((c >= 'A') && (c <= 'Z')) return c + 32;
+  return c;
+}
+
+static int rp_casecmp(const unsigned char *a, const unsigned char *b,
+		      ptrdiff_t len)
+{
+  ptrdiff_t i;
+  for (i = 0; i < len; i++) {
+    if (rp_lower(a[i]) != rp_lower(b[i])) return 1;
+  }
+  return 0;
+}
+
+static struct pike_string *rp_make_header_name(const unsigned char *s,
+					       ptrdiff_t len, int keep_case)
+{
+  struct pike_string *res;
+  ptrdiff_t i;
+
+  if (!keep_case) {
+    for (i = 0; i < (ptrdiff_t)NELEM(rp_common_headers); i++) {
+      struct pike_string *c = rp_common_headers[i];
+      if ((c->len == len) && !rp_casecmp(STR0(c), s, len)) {
+	add_ref(c);
+	return c;
+      }
+    }
+  }
+
+  res = begin_shared_string(len);
+  if (keep_case) {
+    memcpy(STR0(res), s, len);
+  } else {
+    for (i = 0; i < len; i++) {
+      STR0(res)[i] = rp_lower(s[i]);
+    }
+  }
+  return end_shared_string(res);
+}
+
+/* Add a header to the mapping. Steals the references to name and val.
+ * Repeated headers are collected in arrays.
+ */
+static void rp_add_header(struct mapping *m, struct pike_string *name,
+			  struct pike_string *val)
+{
+  struct svalue *old;
+
+  push_string(name);
+  push_string(val);
+
+  if ((old = low_mapping_lookup(m, Pike_sp-2))) {
+    if (TYPEOF(*old) == PIKE_T_ARRAY) {
+      ref_push_array(old->u.array);
+      stack_swap();
+      f_aggregate(1);
+      f_add(2);
+    } else {
+      push_svalue(old);
+      stack_swap();
+      f_aggregate(2);
+    }
+  }
+  mapping_insert(m, Pike_sp-2, Pike_sp-1);
+  pop_n_elems(2);
+}
+
+/* Update the body framing from a header. Returns an error message if
+ * the header is invalid, or conflicts with earlier ones in a way that
+ * could make the request be framed differently by other parsers (RFC
+ * 7230 3.3.2 and 3.3.3).
+ */
+static const char *rp_update_framing(struct rp_framing *framing,
+				     struct pike_string *name,
+				     struct pike_string *val)
+{
+  const unsigned char *v = STR0(val);
+  ptrdiff_t j;
+
+  if ((name->len == 14) &&
+      !rp_casecmp(STR0(name), (const unsigned char *)"content-length", 14)) {
+    INT64 cl = 0;
+    if (!val->len) return "Invalid Content-Length.";
+    for (j = 0; j < val->len; j++) {
+      if (!WIDE_ISDIGIT(v[j])) return "Invalid Content-Length.";
+      if (cl > (MAX_INT64 - 9)/10) return "Too large Content-Length.";
+      cl = cl * 10 + v[j] - '0';
+    }
+    if (framing->content_length_seen && (framing->content_length != cl))
+      return "Conflicting Content-Length headers.";
+    framing->content_length = cl;
+    framing->content_length_seen = 1;
+  } else if ((name->len == 17) &&
+	     !rp_casecmp(STR0(name),
+			 (const unsigned char *)"transfer-encoding", 17)) {
+    /* The codings are applied in order, so chunked must be the last
+     * one, and may only be applied once.
+     */
+    j = 0;
+    while (j < val->len) {
+      ptrdiff_t ts, te;
+      while ((j < val->len) &&
+	     ((v[j] == ' ') || (v[j] == '\t') || (v[j] == ','))) j++;
+      if (j >= val->len) break;
+      ts = j;
+      while ((j < val->len) && (v[j] != ',')) j++;
+      te = j;
+      while ((te > ts) && ((v[te-1] == ' ') || (v[te-1] == '\t'))) te--;
+      if (framing->chunked) return "Invalid Transfer-Encoding.";
+      framing->chunked = (te - ts == 7) &&
+	!rp_casecmp(v + ts, (const unsigned char *)"chunked", 7);
+    }
+    framing->transfer_encoding = 1;
+  }
+  return NULL;
+}
+
+/* Parse a block of header lines (without the request line, but
+ * possibly including the terminating empty line) into the mapping m.
+ *
+ * If framing is non-NULL it is updated from any Content-Length and
+ * Transfer-Encoding headers, and an error is thrown if they are
+ * invalid.
+ */
+static void rp_parse_header_lines(struct mapping *m,
+				  const unsigned char *in, ptrdiff_t l,
+				  int keep_case, struct rp_framing *framing)
+{
+  ptrdiff_t i = 0;
+
+  while (i < l) {
+    ptrdiff_t ls = i, colon, vs, ve;
+    struct pike_string *name, *val;
+
+    /* Find the colon. */
+    for (colon = ls; colon < l; colon++) {
+      if ((in[colon] == ':') || (in[colon] == '\n')) break;
+    }
+    if ((colon >= l) || (in[colon] != ':')) {
+      /* Empty line or a line without a colon. Skip it. */
+      i = colon + 1;
+      continue;
+    }
+    if ((colon > ls) && ((in[colon-1] == ' ') || (in[colon-1] == '\t'))) {
+      /* Would otherwise hide eg Content-Length from the framing
+       * checks (RFC 7230 3.2.4).
+       */
+      Pike_error("White space before colon in header.\n");
+    }
+
+    /* Skip leading white space. */
+    vs = colon + 1;
+    while ((vs < l) && ((in[vs] == ' ') || (in[vs] == '\t'))) vs++;
+
+    /* Find the end of the value, including continuation lines. */
+    ve = vs;
+    while (1) {
+      while ((ve < l) && (in[ve] != '\n')) ve++;
+      if ((ve + 1 < l) && ((in[ve+1] == ' ') || (in[ve+1] == '\t'))) {
+	ve++;
+	continue;
+      }
+      break;
+    }
+    i = ve + 1;
+
+    /* Remove trailing white space. */
+    while ((ve > vs) && ((in[ve-1] == '\r') || (in[ve-1] == ' ') ||
+			 (in[ve-1] == '\t'))) {
+      ve--;
+    }
+
+    name = rp_make_header_name(in + ls, colon - ls, keep_case);
+
+    if (memchr(in + vs, '\n', ve - vs)) {
+      /* Folded header. Join the lines (keeping the leading white space
+       * of the continuation lines, like HeaderParser).
+       */
+      struct string_builder sb;
+      ptrdiff_t j;
+      init_string_builder_alloc(&sb, ve - vs, 0);
+      for (j = vs; j < ve; j++) {
+	if (in[j] == '\r') continue;
+	if (in[j] == '\n') continue;
+	string_builder_putchar(&sb, in[j]);
+      }
+      val = finish_string_builder(&sb);
+    } else {
+      val = make_shared_binary_string((const char *)in + vs, ve - vs);
+    }
+
+    if (framing) {
+      const char *err = rp_update_framing(framing, name, val);
+      if (err) {
+	free_string(name);
+	free_string(val);
+	Pike_error("%s\n", err);
+      }
+    }
+
+    rp_add_header(m, name, val);
+  }
+}
+
+/* Find the end of the header block (the position after the empty
+ * line), starting at *scan_pos. Returns -1 if not found, in which
+ * case *scan_pos is updated to where scanning should resume.
+ */
+static ptrdiff_t rp_find_header_end(const unsigned char *p, size_t len,
+				    size_t *scan_pos)
+{
+  size_t i = *scan_pos;
+
+  while (i < len) {
+    const unsigned char *nl = memchr(p + i, '\n', len - i);
+    if (!nl) {
+      i = len;
+      break;
+    }
+    i = nl - p;
+    if (i + 1 >= len) break;
+    if (p[i+1] == '\n') return i + 2;
+    if (p[i+1] == '\r') {
+      if (i + 2 >= len) break;
+      if (p[i+2] == '\n') return i + 3;
+    }
+    i++;
+  }
+  *scan_pos = i;
+  return -1;
+}
+
+static void rp_reset(struct request_parser *rp)
+{
+  if (rp->have_body) {
+    free_string_builder(&rp->body);
+    rp->have_body = 0;
+  }
+  rp->state = RP_HEADERS;
+  rp->scan_pos = 0;
+  rp->left = 0;
+}
+
+static void f_rp_init( struct object *UNUSED(o) )
+{
+  TRP->headers = NULL;
+  TRP->left = 0;
+  TRP->content_length = 0;
+  TRP->scan_pos = 0;
+  TRP->max_header_size = 512 * 1024;
+  TRP->max_body_size = 0;
+  TRP->state = RP_HEADERS;
+  TRP->keep_case = 0;
+  TRP->have_body = 0;
+}
+
+static void f_rp_exit( struct object *UNUSED(o) )
+{
+  if (TRP->have_body) {
+    free_string_builder(&TRP->body);
+    TRP->have_body = 0;
+  }
+}
+
+static Buffer *rp_get_buffer(INT32 args, const char *fun)
+{
+  Buffer *io;
+  if ((args != 1) || (TYPEOF(Pike_sp[-1]) != PIKE_T_OBJECT) ||
+      !(io = io_buffer_from_object(Pike_sp[-1].u.object)))
+    SIMPLE_ARG_TYPE_ERROR(fun, 1, "Stdio.Buffer");
+  return io;
+}
+
+static void f_rp_read_headers( INT32 args )
+/*! @decl array(string|mapping)|zero read_headers(Stdio.Buffer buf)
+ *!
+ *! Parse the request line and header block of a request from @[buf].
+ *!
+ *! Any empty lines before the request line are skipped.
+ *!
+ *! @returns
+ *!   Returns @expr{0@} (zero) if @[buf] does not yet contain a
+ *!   complete header block, in which case no data is consumed.
+ *!   Call again when more data has been added.
+ *!
+ *!   Otherwise the header block is consumed from @[buf], and
+ *!   an array with the following elements is returned:
+ *!   @array
+ *!     @elem string(8bit) 0
+ *!       The request method, eg @expr{"GET"@}.
+ *!     @elem string(8bit) 1
+ *!       The request target (ie the full query).
+ *!     @elem string(8bit) 2
+ *!       The protocol, eg @expr{"HTTP/1.1"@}. @expr{"HTTP/0.9"@}
+ *!       for requests without a protocol.
+ *!     @elem mapping(string(8bit):string(8bit)|array(string(8bit))) 3
+ *!       The headers. Repeated headers are collected in arrays.
+ *!     @elem string(8bit) 4
+ *!       The request line.
+ *!     @elem string(8bit) 5
+ *!       The raw header block, including the request line.
+ *!   @endarray
+ *!
+ *!   After this the body (if any) should be read with @[read_body()].
+ *!
+ *! @throws
+ *!   Throws an error if the header block or the body is larger than
+ *!   the limits given to @[create()].
+ *!
+ *!   Also throws an error if the framing of the body is ambiguous,
+ *!   ie for invalid or conflicting @tt{Content-Length@} headers, for
+ *!   a @tt{Transfer-Encoding@} that doesn't end with @tt{chunked@},
+ *!   and for requests with both @tt{Content-Length@} and
+ *!   @tt{Transfer-Encoding@} (@rfc{7230:3.3.3@}), and for header
+ *!   names followed by white space (@rfc{7230:3.2.4@}).
+ */
+{
+  struct request_parser *rp = TRP;
+  Buffer *io = rp_get_buffer(args, "read_headers");
+  struct rp_framing framing;
+  const unsigned char *p;
+  ptrdiff_t end, eol, line_len, first_sp, last_sp, i;
+  size_t len;
+  int spaces = 0;
+
+  if (rp->state != RP_HEADERS) {
+    /* The previous body wasn't read. */
+    rp_reset(rp);
+  }
+
+  p = io_read_pointer(io);
+  len = io_len(io);
+
+  if (!rp->scan_pos) {
+    /* Skip leading empty lines. */
+    for (i = 0; (size_t)i < len; i++) {
+      if ((p[i] != '\r') && (p[i] != '\n') && (p[i] != ' ') &&
+	  (p[i] != '\t')) break;
+    }
+    if (i) {
+      io_consume(io, i);
+      p = io_read_pointer(io);
+      len = io_len(io);
+    }
+  }
+
+  if (!len) {
+    pop_n_elems(args);
+    push_int(0);
+    return;
+  }
+
+  /* Find the request line. */
+  {
+    const unsigned char *nl = memchr(p, '\n', len);
+    if (!nl) {
+      if (len > rp->max_header_size)
+	Pike_error("Too large request line.\n");
+      pop_n_elems(args);
+      push_int(0);
+      return;
+    }
+    eol = nl - p;
+  }
+  line_len = eol;
+  if (line_len && (p[line_len-1] == '\r')) line_len--;
+
+  first_sp = last_sp = -1;
+  for (i = 0; i < line_len; i++) {
+    if (p[i] == ' ') {
+      if (first_sp < 0) first_sp = i;
+      last_sp = i;
+      spaces++;
+    }
+  }
+
+  if (spaces < 2) {
+    /* HTTP/0.9 (or a broken request). There are no headers. */
+    end = eol + 1;
+  } else {
+    if (rp->scan_pos < (size_t)eol) rp->scan_pos = eol;
+    end = rp_find_header_end(p, len, &rp->scan_pos);
+    if (end < 0) {
+      if (len > rp->max_header_size)
+	Pike_error("Too large request header.\n");
+      pop_n_elems(args);
+      push_int(0);
+      return;
+    }
+  }
+
+  /* We have a complete header block in p[0..end-1]. */
+  rp->scan_pos = 0;
+  if ((size_t)end > rp->max_header_size)
+    Pike_error("Too large request header.\n");
+
+  if (first_sp < 0) {
+    push_static_text("GET");
+    push_string(make_shared_binary_string((const char *)p, line_len));
+    push_static_text("HTTP/0.9");
+  } else if ((first_sp != last_sp) && (line_len - last_sp > 4) &&
+	     !memcmp(p + last_sp + 1, "HTTP", 4)) {
+    push_string(make_shared_binary_string((const char *)p, first_sp));
+    push_string(make_shared_binary_string((const char *)p + first_sp + 1,
+					  last_sp - first_sp - 1));
+    push_string(make_shared_binary_string((const char *)p + last_sp + 1,
+					  line_len - last_sp - 1));
+  } else {
+    push_string(make_shared_binary_string((const char *)p, first_sp));
+    push_string(make_shared_binary_string((const char *)p + first_sp + 1,
+					  line_len - first_sp - 1));
+    push_static_text("HTTP/0.9");
+  }
+
+  if (rp->headers) {
+    free_mapping(rp->headers);
+    rp->headers = NULL;
+  }
+  push_mapping(allocate_mapping(8));
+  add_ref(rp->headers = Pike_sp[-1].u.mapping);
+
+  memset(&framing, 0, sizeof(framing));
+  rp_parse_header_lines(rp->headers, p + eol + 1, end - eol - 1,
+			rp->keep_case, &framing);
+
+  if (framing.transfer_encoding) {
+    /* A final coding other than chunked leaves the length of the body
+     * unknown, and a Content-Length along with it is a sign of request
+     * smuggling.
+     */
+    if (!framing.chunked)
+      Pike_error("Unsupported Transfer-Encoding.\n");
+    if (framing.content_length_seen)
+      Pike_error("Both Content-Length and Transfer-Encoding.\n");
+  } else if (rp->max_body_size &&
+	     (framing.content_length > rp->max_body_size)) {
+    Pike_error("Too large request body.\n");
+  }
+
+  push_string(make_shared_binary_string((const char *)p, line_len));
+  push_string(make_shared_binary_string((const char *)p, end));
+
+  io_consume(io, end);
+
+  if (framing.chunked) {
+    rp->content_length = -1;
+    rp->state = RP_CHUNK_SIZE;
+    init_string_builder(&rp->body, 0);
+    rp->have_body = 1;
+  } else {
+    rp->content_length = framing.content_length;
+    rp->left = framing.content_length;
+    rp->state = RP_BODY;
+  }
+
+  f_aggregate(6);
+  stack_pop_n_elems_keep_top(args);
+}
+
+/* Read a line (terminated by LF) from the buffer.
+ * Returns the length of the line excluding the CRLF/LF,
+ * and sets *consume to the length including it.
+ * Returns -1 if no complete line is available.
+ */
+static ptrdiff_t rp_get_line(Buffer *io, size_t *consume)
+{
+  const unsigned char *p = io_read_pointer(io);
+  const unsigned char *nl = memchr(p, '\n', io_len(io));
+  ptrdiff_t l;
+  if (!nl) return -1;
+  l = nl - p;
+  *consume = l + 1;
+  if (l && (p[l-1] == '\r')) l--;
+  return l;
+}
+
+static void f_rp_read_body( INT32 args )
+/*! @decl string(8bit)|zero read_body(Stdio.Buffer buf)
+ *!
+ *! Read the body of the request whose headers were returned by
+ *! the most recent call of @[read_headers()].
+ *!
+ *! Chunked transfer-encoding is decoded, and any trailer headers
+ *! are added to the header mapping returned by @[read_headers()].
+ *!
+ *! @returns
+ *!   Returns the body (@expr{""@} if the request has no body) when
+ *!   all of it is available. Data following the body is left in
+ *!   @[buf] (eg pipelined requests).
+ *!
+ *!   Returns @expr{0@} (zero) if more data is needed. Any data
+ *!   that can be processed is still consumed from @[buf].
+ *!
+ *! @throws
+ *!   Throws errors on malformed chunked encoding, if the decoded
+ *!   body is larger than the limit given to @[create()], or if
+ *!   @[read_headers()] hasn't been called.
+ */
+{
+  struct request_parser *rp = TRP;
+  Buffer *io = rp_get_buffer(args, "read_body");
+  struct pike_string *res = NULL;
+
+  switch(rp->state) {
+  case RP_HEADERS:
+    Pike_error("No request headers have been read.\n");
+    break;
+
+  case RP_BODY:
+    if ((INT64)io_len(io) < rp->left) break;
+    res = make_shared_binary_string((const char *)io_read_pointer(io),
+				    rp->left);
+    io_consume(io, rp->left);
+    break;
+
+  default:
+    while (!res) {
+      size_t consume;
+      ptrdiff_t l;
+
+      if (rp->state == RP_CHUNK_DATA) {
+	size_t n = io_len(io);
+	if (!n) break;
+	if ((INT64)n > rp->left) n = rp->left;
+	string_builder_binary_strcat0(&rp->body, io_read_pointer(io), n);
+	io_consume(io, n);
+	if (!(rp->left -= n)) rp->state = RP_CHUNK_CRLF;
+	continue;
+      }
+
+      l = rp_get_line(io, &consume);
+      if (l < 0) {
+	if (io_len(io) > RP_MAX_CHUNK_LINE)
+	  Pike_error("Invalid chunked encoding.\n");
+	break;
+      }
+
+      switch(rp->state) {
+      case RP_CHUNK_SIZE:
+	{
+	  const unsigned char *p = io_read_pointer(io);
+	  INT64 size = 0;
+	  ptrdiff_t i;
+	  for (i = 0; i < l; i++) {
+	    int c = p[i];
+	    if (!isxdigit(c)) break;
+	    if (size > (MAX_INT64>>4))
+	      Pike_error("Too large chunk.\n");
+	    size = (size<<4) | ((c <= '9')?(c - '0'):((c|0x20) - 'a' + 10));
+	  }
+	  if (!i) Pike_error("Invalid chunked encoding.\n");
+	  if (rp->max_body_size &&
+	      (size > rp->max_body_size - (INT64)rp->body.s->len))
+	    Pike_error("Too large request body.\n");
+	  rp->left = size;
+	  rp->state = size?RP_CHUNK_DATA:RP_TRAILER;
+	}
+	break;
+      case RP_CHUNK_CRLF:
+	if (l) Pike_error("Invalid chunked encoding.\n");
+	rp->state = RP_CHUNK_SIZE;
+	break;
+      case RP_TRAILER:
+	if (!l) {
+	  res = finish_string_builder(&rp->body);
+	  rp->have_body = 0;
+	} else if (rp->headers) {
+	  rp_parse_header_lines(rp->headers, io_read_pointer(io), l,
+				rp->keep_case, NULL);
+	}
+	break;
+      }
+      io_consume(io, consume);
+    }
+    break;
+  }
+
+  pop_n_elems(args);
+  if (res) {
+    rp->state = RP_HEADERS;
+    rp->left = 0;
+    push_string(res);
+  } else {
+    push_int(0);
+  }
+}
+
+static void f_rp_content_length( INT32 args )
+/*! @decl int(-1..) content_length()
+ *!
+ *! Returns the length of the body of the current request as
+ *! indicated by its headers, or @expr{-1@} if the body uses
+ *! chunked transfer-encoding.
+ */
+{
+  pop_n_elems(args);
+  push_int64(TRP->content_length);
+}
+
+static void f_rp_reset( INT32 args )
+/*! @decl void reset()
+ *!
+ *! Abort parsing of the current request, eg if the
+ *! buffer has been modified by the caller.
+ */
+{
+  pop_n_elems(args);
+  rp_reset(TRP);
+}
+
+static void f_rp_create( INT32 args )
+/*! @decl void create(void|int(0..) max_header_size, void|int keep_case, @
+ *!                     void|int(0..) max_body_size)
+ *!
+ *! @param max_header_size
+ *!   Maximum size of the header block. Defaults to 512 KiB.
+ *!
+ *! @param keep_case
+ *!   If true the parser will not normalize the case of header names.
+ *!
+ *! @param max_body_size
+ *!   Maximum size of the request body. @[read_headers()] and
+ *!   @[read_body()] throw errors for requests with larger bodies.
+ *!   Defaults to no limit.
+ */
+{
+  INT_TYPE max_header_size = 0;
+  INT_TYPE keep_case = 0;
+  INT_TYPE max_body_size = 0;
+  get_all_args("create", args, ".%+%i%+", &max_header_size, &keep_case,
+	       &max_body_size);
+
+  rp_reset(TRP);
+  if (max_header_size) TRP->max_header_size = max_header_size;
+  TRP->keep_case = !!keep_case;
+  TRP->max_body_size = max_body_size;
+}
+
 /*! @endclass
  */
 
@@ -742,8 +1476,44 @@ PIKE_MODULE_INIT
 	       tFunc(tStr tOr(tInt01,tVoid),tArr(tOr(tStr,tMapping))), 0);
   ADD_FUNCTION( "create", f_hp_create, tFunc(tOr(tInt,tVoid) tOr(tInt,tVoid) tOr(tInt,tVoid),tVoid), ID_PROTECTED );
   end_class( "HeaderParser", 0 );
+
+  {
+    size_t i;
+    ptrdiff_t offset;
+    for (i = 0; i < NELEM(rp_common_header_names); i++) {
+      rp_common_headers[i] = make_shared_string(rp_common_header_names[i]);
+    }
+
+    start_new_program();
+    offset = ADD_STORAGE( struct request_parser );
+    PIKE_MAP_VARIABLE("__headers",
+		      offset + OFFSETOF(request_parser, headers),
+		      tMapping, PIKE_T_MAPPING,
+		      ID_PROTECTED|ID_PRIVATE|ID_HIDDEN);
+    set_init_callback( f_rp_init );
+    set_exit_callback( f_rp_exit );
+    ADD_FUNCTION( "read_headers", f_rp_read_headers,
+		  tFunc(tObj, tOr(tArr(tOr(tStr8,tMapping)), tZero)), 0 );
+    ADD_FUNCTION( "read_body", f_rp_read_body,
+		  tFunc(tObj, tOr(tStr8, tZero)), 0 );
+    ADD_FUNCTION( "content_length", f_rp_content_length,
+		  tFunc(tNone, tInt), 0 );
+    ADD_FUNCTION( "reset", f_rp_reset, tFunc(tNone, tVoid), 0 );
+    ADD_FUNCTION( "create", f_rp_create,
+		  tFunc(tOr(tIntPos,tVoid) tOr(tInt,tVoid) tOr(tIntPos,tVoid),
+			tVoid),
+		  ID_PROTECTED );
+    end_class( "RequestParser", 0 );
+  }
 }
 
 PIKE_MODULE_EXIT
 {
+  size_t i;
+  for (i = 0; i < NELEM(rp_common_header_names); i++) {
+    if (rp_common_headers[i]) {
+      free_string(rp_common_headers[i]);
+      rp_common_headers[i] = NULL;
+    }
+  }
 }
@@ -1,6 +1,7 @@
 #include "global.h"
 #include "stralloc.h"
 #include "global.h"
+#include "pike_macros.h"
 #include "interpret.h"
 #include "program.h"
 #include "object.h"
@@ -16,6 +17,10 @@
 #include "blob.h"
 #include "buffer.h"
 
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 #define sp Pike_sp
 
 static void exit_blob_struct( );
@@ -24,22 +29,177 @@ static void exit_blob_struct( );
   +-----------+----------+---------+---------+---------+
   | docid: 32 | nhits: 8 | hit: 16 | hit: 16 | hit: 16 |...
   +-----------+----------+---------+---------+---------+
+
+  Block compressed chunks start with the byte BLOB_FORMAT_BLOCKS,
+  followed by blocks of up to BLOB_BLOCK_SIZE documents:
+
+  +----------+----------+------------+------------+
+  | last: 32 | size: 32 | ndocs-1: 8 | maxhits: 8 |...
+  +----------+----------+------------+------------+
+  +-----------------+---------------+--------------+--------------+
+  | keys: ndocs/4*8 | deltas: 8..32 | nhits: ndocs | hits: 16 ... |
+  +-----------------+---------------+--------------+--------------+
+
+  last is the last docid of the block and size the number of bytes
+  after the header, so blocks can be skipped by reading only their
+  headers. maxhits is the largest nhits in the block. The docids are
+  stored as the difference to the previous one, starting from 0 in
+  every chunk, as 1 to 4 little endian bytes (StreamVByte). Every key
+  byte holds the lengths-1 of four differences, lowest bits first. The
+  hits are stored as in the original format, in document order.
 */
 
-int wf_blob_next( Blob *b )
+#define BLOCK_HEADER 10
+
+static unsigned char key_len[256];
+#ifdef __SSSE3__
+static unsigned char key_shuffle[256][16];
+#endif
+
+static void init_key_tables(void)
 {
-  /* Find the next document ID */
-  if( b->eof )
-    return 0;
+  int k, j;
+  for( k = 0; k<256; k++ )
+  {
+    int pos = 0;
+    for( j = 0; j<4; j++ )
+    {
+      int len = ((k >> (j*2)) & 3) + 1;
+#ifdef __SSSE3__
+      int t;
+      for( t = 0; t<4; t++ )
+	key_shuffle[k][j*4+t] = t < len ? pos+t : 0x80;
+#endif
+      pos += len;
+    }
+    key_len[k] = pos;
+  }
+}
 
-  b->docid = 0;
-  if( b->b->rpos >= b->b->size )
+static unsigned int blob_rint( unsigned char *d )
+{
+  return (((((d[0]<<8) | d[1])<<8) | d[2])<<8) | d[3];
+}
+
+/* Decode n docid differences with the lengths in keys and the data
+ * starting at d, and add them up from base. Returns the end of the
+ * data, or NULL if it would pass end.
+ */
+static unsigned char *decode_docids( unsigned int *docids, int n,
+				     unsigned char *keys, unsigned char *d,
+				     unsigned char *end, unsigned int base )
+{
+  int i = 0;
+#ifdef __SSSE3__
+  /* Four documents per key byte, as long as 16 bytes can be loaded.
+   * The prefix sum is done in the register as well.
+   */
+  __m128i prev = _mm_set1_epi32( base );
+  for( ; i + 4 <= n && d + 16 <= end; i += 4 )
+  {
+    int key = keys[i/4];
+    __m128i v = _mm_loadu_si128( (__m128i *)d );
+    v = _mm_shuffle_epi8( v, _mm_loadu_si128( (__m128i *)key_shuffle[key] ) );
+    v = _mm_add_epi32( v, _mm_slli_si128( v, 4 ) );
+    v = _mm_add_epi32( v, _mm_slli_si128( v, 8 ) );
+    v = _mm_add_epi32( v, prev );
+    _mm_storeu_si128( (__m128i *)(docids + i), v );
+    prev = _mm_shuffle_epi32( v, 0xff );
+    d += key_len[key];
+  }
+  if( i )
+    base = docids[i-1];
+#endif
+  for( ; i<n; i++ )
+  {
+    int len = ((keys[i/4] >> ((i&3)*2)) & 3) + 1, j;
+    unsigned int delta = 0;
+    if( d + len > end )
+      return NULL;
+    for( j = len-1; j >= 0; j-- )
+      delta = (delta<<8) | d[j];
+    d += len;
+    docids[i] = base += delta;
+  }
+  return d;
+}
+
+/* Decode the block at the read position of a block compressed chunk,
+ * and move the read position to the next block.
+ */
+static void blob_decode_block( Blob *b )
+{
+  unsigned char *d = b->b->data + b->b->rpos;
+  unsigned char *keys, *end;
+  unsigned int size, last, off = 0;
+  int i, n, max;
+
+  if( b->b->size - b->b->rpos < BLOCK_HEADER ||
+      (size = blob_rint( d + 4 )) > b->b->size - b->b->rpos - BLOCK_HEADER )
+    Pike_error("Truncated block in blob.\n");
+  last = blob_rint( d );
+  n = d[8] + 1;
+  max = d[9];
+  keys = d + BLOCK_HEADER;
+  end = keys + size;
+  d = keys + (n+3)/4;
+  if( d > end ||
+      !(d = decode_docids( b->block_docids, n, keys, d, end,
+			   b->block_last )) ||
+      b->block_docids[n-1] != last ||
+      d + n > end )
+    Pike_error("Corrupt block in blob.\n");
+
+  for( i = 0; i<n; i++ )
+  {
+    b->block_hitoff[i] = off;
+    off += d[i]*2;
+  }
+  if( d + n + off != end )
+    Pike_error("Corrupt block in blob.\n");
+
+  b->block_nhits = d;
+  b->block_hits = d + n;
+  b->block_n = n;
+  b->block_pos = 0;
+  b->block_last = last;
+  b->block_max = max;
+  b->b->rpos += BLOCK_HEADER + size;
+}
+
+/* Set up reading of a new chunk from the feed function. */
+static void blob_start_chunk( Blob *b )
+{
+  b->nskip = -1;
+  b->block_n = b->block_pos = 0;
+  b->block_last = 0;
+  b->format = b->b->size && (b->b->data[0] & 0x80);
+  if( b->format )
+  {
+    if( b->b->data[0] != BLOB_FORMAT_BLOCKS )
+      Pike_error("Unknown blob format 0x%x.\n", b->b->data[0]);
+    b->b->rpos = 1;
+  }
+}
+
+/* True when there are no more documents in the current chunk. */
+static int blob_chunk_done( Blob *b )
+{
+  return b->block_pos >= b->block_n && b->b->rpos >= b->b->size;
+}
+
+/* Fetch more hits from the feed function until there is data to
+ * read. Returns 0 when there are no more hits.
+ */
+static int blob_fill( Blob *b )
+{
+  while( blob_chunk_done( b ) )
   {
     if( !b->feed )
     {
       wf_buffer_clear( b->b );
       b->eof = 1;
-      return -1;
+      return 0;
     }
     ref_push_string( b->word );
     push_int( b->docid );
@@ -47,38 +207,209 @@ int wf_blob_next( Blob *b )
     apply_svalue( b->feed, 3 );
     if( TYPEOF(sp[-1]) != T_STRING )
     {
+      pop_stack();
       b->eof = 1;
-      return -1;
+      return 0;
     }
+    /* The buffer keeps a reference to the string. */
     wf_buffer_set_pike_string( b->b, sp[-1].u.string, 1 );
+    pop_stack();
+    blob_start_chunk( b );
   }
-  else
-  {
+  if( b->format && b->block_pos >= b->block_n )
+    blob_decode_block( b );
+  return 1;
+}
+
+int wf_blob_next( Blob *b )
+{
+  /* Find the next document ID */
+  if( b->eof )
+    return 0;
+
+  b->docid = 0;
+  if( b->format )
+    b->block_pos++;
+  else if( b->b->rpos < b->b->size )
     /* FF past current docid */
     b->b->rpos += 4 + 1 + 2*wf_blob_nhits( b );
-    if( b->b->rpos >= b->b->size )
+  if( !blob_fill( b ) )
+    return -1;
+  return wf_blob_docid( b );
+}
+
+#define SKIP_INTERVAL 16
+
+/* Build a table with the docid and offset of every SKIP_INTERVAL:th
+ * document in the current buffer, and the last docid and the most
+ * hits in each such group. Only the docids and hit counts are read
+ * when stepping over the documents.
+ */
+static void blob_index( Blob *b )
+{
+  unsigned char *d = b->b->data;
+  unsigned int pos = 0, size = b->b->size;
+  struct blob_skip *g = NULL;
+  int n;
+
+  b->nskip = 0;
+  for( n = 0; pos + 5 <= size; n++ )
+  {
+    if( !(n % SKIP_INTERVAL) )
     {
-      if( !b->feed )
+      if( b->nskip == b->skip_size )
       {
-	wf_buffer_clear( b->b );
-	b->eof = 1;
-	return -1;
+	b->skip_size = b->skip_size ? b->skip_size*2 : 64;
+	b->skip = xrealloc( b->skip, b->skip_size*sizeof(struct blob_skip) );
       }
-      ref_push_string( b->word );
-      push_int( b->docid );
-      push_int64( (INT64) b );
-      apply_svalue( b->feed, 3 );
-      if( TYPEOF(sp[-1]) != T_STRING )
-      {
-	b->eof = 1;
+      g = b->skip + b->nskip++;
+      g->docid = blob_rint( d + pos );
+      g->off = pos;
+      g->maxhits = 0;
+    }
+    g->last = blob_rint( d + pos );
+    if( d[pos+4] > g->maxhits )
+      g->maxhits = d[pos+4];
+    pos += 4 + 1 + 2*d[pos+4];
+  }
+  b->last_docid = n ? g->last : 0;
+}
+
+/* Step over the blocks of a block compressed chunk that end before
+ * docid, or forward in the current block if docid is in it.
+ */
+static void blob_skip_blocks( Blob *b, unsigned int docid )
+{
+  if( b->block_last >= docid )
+  {
+    while( b->block_docids[b->block_pos] < docid )
+      b->block_pos++;
+    return;
+  }
+
+  b->block_pos = b->block_n;
+  while( b->b->size - b->b->rpos >= BLOCK_HEADER )
+  {
+    unsigned char *d = b->b->data + b->b->rpos;
+    unsigned int last = blob_rint( d ), size = blob_rint( d + 4 );
+    if( last >= docid )
+      break;
+    if( size > b->b->size - b->b->rpos - BLOCK_HEADER )
+      Pike_error("Truncated block in blob.\n");
+    b->block_last = last;
+    b->b->rpos += BLOCK_HEADER + size;
+  }
+}
+
+int wf_blob_skip_to( Blob *b, unsigned int docid )
+{
+  if( b->eof )
+    return -1;
+  if( blob_chunk_done( b ) && wf_blob_next( b ) == -1 )
+    return -1;
+
+  while( (unsigned int)wf_blob_docid( b ) < docid )
+  {
+    int lo, hi;
+
+    if( b->format )
+    {
+      blob_skip_blocks( b, docid );
+      if( !blob_fill( b ) )
 	return -1;
-      }
-      wf_buffer_set_pike_string( b->b, sp[-1].u.string, 1 );
+      continue;
     }
+
+    if( b->nskip < 0 )
+      blob_index( b );
+
+    if( !b->nskip || b->last_docid < docid )
+    {
+      /* Not in this buffer. */
+      b->b->rpos = b->b->size;
+      b->docid = 0;
+      if( !blob_fill( b ) )
+	return -1;
+      continue;
+    }
+
+    /* Find the last block that starts at or before docid. */
+    lo = 0;
+    hi = b->nskip - 1;
+    while( lo < hi )
+    {
+      int mid = (lo + hi + 1) / 2;
+      if( b->skip[mid].docid <= docid )
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+    if( b->skip[lo].off > b->b->rpos )
+    {
+      b->b->rpos = b->skip[lo].off;
+      b->docid = 0;
+    }
+
+    while( b->b->rpos < b->b->size &&
+	   (unsigned int)wf_blob_docid( b ) < docid )
+    {
+      b->b->rpos += 4 + 1 + 2*wf_blob_nhits( b );
+      b->docid = 0;
+    }
+    if( !blob_fill( b ) )
+      return -1;
   }
   return wf_blob_docid( b );
 }
 
+/* The skip table group of the current document in a chunk in the
+ * original format, or NULL if the chunk has no complete documents.
+ */
+static struct blob_skip *blob_group( Blob *b )
+{
+  int lo = 0, hi;
+
+  if( b->nskip < 0 )
+    blob_index( b );
+  if( !b->nskip )
+    return NULL;
+
+  hi = b->nskip - 1;
+  while( lo < hi )
+  {
+    int mid = (lo + hi + 1) / 2;
+    if( b->skip[mid].off <= b->b->rpos )
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return b->skip + lo;
+}
+
+int wf_blob_block_max( Blob *b )
+{
+  struct blob_skip *g;
+  if( b->eof )
+    return 0;
+  if( b->format )
+    return b->block_max;
+  if( !(g = blob_group( b )) )
+    return 255;
+  return g->maxhits;
+}
+
+unsigned int wf_blob_block_last( Blob *b )
+{
+  struct blob_skip *g;
+  if( b->eof )
+    return 0xffffffff;
+  if( b->format )
+    return b->block_last;
+  if( !(g = blob_group( b )) )
+    return wf_blob_docid( b );
+  return g->last;
+}
+
 int wf_blob_eof( Blob *b )
 {
   if( b->eof )
@@ -86,9 +417,19 @@ int wf_blob_eof( Blob *b )
   return 0;
 }
 
+/* The hits of the current document. */
+static unsigned char *blob_hits( Blob *b )
+{
+  if( b->format )
+    return b->block_hits + b->block_hitoff[b->block_pos];
+  return b->b->data + b->b->rpos + 5;
+}
+
 int wf_blob_nhits( Blob *b )
 {
   if( b->eof ) return 0;
+  if( b->format )
+    return b->block_nhits[b->block_pos];
   return ((unsigned char *)b->b->data)[b->b->rpos+4];
 }
 
@@ -98,8 +439,8 @@ int wf_blob_hit_raw( Blob *b, int n )
     return 0;
   else
   {
-    int off = b->b->rpos + 5 + n*2;
-    return (b->b->data[ off ]<<8) | b->b->data[ off + 1 ];
+    unsigned char *h = blob_hits( b ) + n*2;
+    return (h[0]<<8) | h[1];
   }
 }
 
@@ -114,9 +455,9 @@ Hit wf_blob_hit( Blob *b, int n )
   }
   else
   {
-    int off = b->b->rpos + 5 + n*2;
-    unsigned char h =  b->b->data[ off ];
-    unsigned char l = b->b->data[ off + 1 ];
+    unsigned char *d = blob_hits( b ) + n*2;
+    unsigned char h =  d[ 0 ];
+    unsigned char l = d[ 1 ];
     unsigned short ht= (h<<8) | l;
     hit.raw = ht;
     if( (ht>>14) == 3 )
@@ -139,17 +480,12 @@ int wf_blob_docid( Blob *b )
 {
   if( b->eof )
     return -1;
+  if( b->format )
+    return b->docid = b->block_docids[b->block_pos];
   if( b->docid > 0 )
     return b->docid;
   else
-  {
-    int off = b->b->rpos;
-    unsigned char hh =  b->b->data[ off ];
-    unsigned char hl = b->b->data[ off+1 ];
-    unsigned char lh =  b->b->data[ off+2 ];
-    unsigned char ll = b->b->data[ off+3 ];
-    return b->docid = ((((((hh<<8) | hl)<<8) | lh)<<8) | ll);
-  }
+    return b->docid = blob_rint( b->b->data + b->b->rpos );
 }
 
 
@@ -161,6 +497,7 @@ Blob *wf_blob_new( struct svalue *feed, struct pike_string *word )
     add_ref(word);
   b->feed = feed;
   b->b = wf_buffer_new();
+  b->nskip = -1;
   return b;
 }
 
@@ -170,6 +507,8 @@ void wf_blob_free( Blob *b )
     wf_buffer_free( b->b );
   if( b->word )
     free_string( b->word );
+  if( b->skip )
+    free( b->skip );
   free( b );
 }
 
@@ -267,21 +606,26 @@ static void _append_hit( struct blob_data *d, int doc_id, int hit )
 
 static void _append_blob( struct blob_data *d, struct pike_string *s )
 {
-  struct buffer *b = wf_buffer_new();
-  wf_buffer_set_pike_string( b, s, 1 );
-  while( !wf_buffer_eof( b ) )
-  {
-    int docid = wf_buffer_rint( b );
-    int nhits = wf_buffer_rbyte( b );
-    struct hash *h = find_hash( d, docid );
-    /* Make use of the fact that this dochash should be empty, and
-     * assume that the incoming data is valid
-     */
-    wf_buffer_rewind_r( b, 5 );
-    wf_buffer_rewind_w( h->data, -1 );
-    wf_buffer_memcpy( h->data, b, nhits*2+5 );
-  }
-  wf_buffer_free( b );
+  Blob *b = wf_blob_new( NULL, NULL );
+  ONERROR err;
+  SET_ONERROR( err, wf_blob_free, b );
+  wf_buffer_set_pike_string( b->b, s, 1 );
+  blob_start_chunk( b );
+  if( blob_fill( b ) )
+    do
+    {
+      int docid = wf_blob_docid( b );
+      int nhits = wf_blob_nhits( b );
+      struct hash *h = find_hash( d, docid );
+      /* Make use of the fact that this dochash should be empty, and
+       * assume that the incoming data is valid
+       */
+      wf_buffer_rewind_w( h->data, -1 );
+      wf_buffer_wint( h->data, docid );
+      wf_buffer_wbyte( h->data, nhits );
+      wf_buffer_append( h->data, blob_hits( b ), nhits*2 );
+    } while( wf_blob_next( b ) != -1 );
+  CALL_AND_UNSET_ONERROR( err );
 }
 
 /*! @module Search
@@ -484,19 +828,87 @@ static void f_blob_memsize( INT32 args )
   push_int( wf_blob_low_memsize( Pike_fp->current_object ) );
 }
 
-/*! @decl string data()
+struct zipp
+{
+  int id;
+  struct buffer *b;
+};
+
+/* Write the sorted documents as a block compressed chunk. */
+static void blob_encode_blocks( struct buffer *res, struct zipp *zipp, int zp )
+{
+  unsigned char keys[BLOB_BLOCK_SIZE/4];
+  unsigned char deltas[BLOB_BLOCK_SIZE*4];
+  unsigned char nhits[BLOB_BLOCK_SIZE];
+  unsigned int prev = 0;
+  int i, j;
+
+  wf_buffer_wbyte( res, BLOB_FORMAT_BLOCKS );
+  for( i = 0; i<zp; i += BLOB_BLOCK_SIZE )
+  {
+    int n = MINIMUM( zp-i, BLOB_BLOCK_SIZE );
+    int nkeys = (n+3)/4, ndeltas = 0, max = 0;
+    unsigned int hits = 0;
+
+    memset( keys, 0, nkeys );
+    for( j = 0; j<n; j++ )
+    {
+      unsigned int docid = zipp[i+j].id, delta = docid - prev;
+      int len = delta < (1<<8) ? 1 : delta < (1<<16) ? 2 :
+	delta < (1<<24) ? 3 : 4, k;
+
+      keys[j/4] |= (len-1) << ((j&3)*2);
+      for( k = 0; k<len; k++ )
+	deltas[ndeltas++] = delta >> (k*8);
+      nhits[j] = zipp[i+j].b->data[4];
+      if( nhits[j] > max )
+	max = nhits[j];
+      hits += nhits[j];
+      prev = docid;
+    }
+
+    wf_buffer_wint( res, prev );
+    wf_buffer_wint( res, nkeys + ndeltas + n + hits*2 );
+    wf_buffer_wbyte( res, n-1 );
+    wf_buffer_wbyte( res, max );
+    wf_buffer_append( res, keys, nkeys );
+    wf_buffer_append( res, deltas, ndeltas );
+    wf_buffer_append( res, nhits, n );
+    for( j = 0; j<n; j++ )
+      wf_buffer_append( res, zipp[i+j].b->data+5, nhits[j]*2 );
+  }
+}
+
+/*! @decl string data(void|int format)
+ *!
+ *! Returns the hits, sorted on document and hit, and clears the
+ *! blob.
+ *!
+ *! @param format
+ *!   @int
+ *!     @value 0
+ *!       The original format, with one docid, hit count and the hits
+ *!       for each document.
+ *!     @value 1
+ *!       Block compressed. The documents are stored in blocks of 128
+ *!       with difference coded docids, and every block starts with
+ *!       its last docid and size so that queries can skip it
+ *!       without decoding. Query feeders and @[create] and @[merge]
+ *!       accept either format.
+ *!   @endint
  */
 
 static void f_blob__cast( INT32 args )
 {
-  struct zipp {
-    int id;
-    struct buffer *b;
-  } *zipp;
-  int i, zp=0;
+  struct zipp *zipp;
+  int i, zp=0, format = 0;
   struct hash *h;
   struct buffer *res;
 
+  get_all_args("data", args, ".%d", &format);
+  if( format < 0 || format > 1 )
+    Pike_error("Unknown blob format %d.\n", format);
+
   zipp = xalloc( THIS->size * sizeof( zipp[0] ) + 1);
 
   for( i = 0; i<HSIZE; i++ )
@@ -541,8 +953,11 @@ static void f_blob__cast( INT32 args )
 
   wf_buffer_set_empty( res );
 
-  for( i = 0; i<zp; i++ )
-    wf_buffer_append( res, zipp[i].b->data, zipp[i].b->size );
+  if( format )
+    blob_encode_blocks( res, zipp, zp );
+  else
+    for( i = 0; i<zp; i++ )
+      wf_buffer_append( res, zipp[i].b->data, zipp[i].b->size );
 
   free( zipp );
 
@@ -575,6 +990,7 @@ static void exit_blob_struct(struct object * o)
 
 void init_blob_program(void)
 {
+  init_key_tables();
   start_new_program();
   ADD_STORAGE( struct blob_data );
   ADD_FUNCTION( "create", f_blob_create, tFunc(tOr(tStr,tVoid),tVoid), 0 );
@@ -582,7 +998,7 @@ void init_blob_program(void)
   ADD_FUNCTION( "add", f_blob_add, tFunc(tInt tInt tInt,tVoid),0 );
   ADD_FUNCTION( "remove", f_blob_remove, tFunc(tInt,tVoid),0 );
   ADD_FUNCTION( "remove_list", f_blob_remove_list, tFunc(tArr(tInt),tVoid), 0);
-  ADD_FUNCTION( "data", f_blob__cast, tFunc(tVoid,tStr), 0 );
+  ADD_FUNCTION( "data", f_blob__cast, tFunc(tOr(tInt,tVoid),tStr), 0 );
   ADD_FUNCTION( "memsize", f_blob_memsize, tFunc(tVoid,tInt), 0 );
   set_init_callback( init_blob_struct );
   set_exit_callback( exit_blob_struct );
@@ -1,3 +1,20 @@
+struct blob_skip
+{
+  unsigned int docid;
+  unsigned int off;
+  unsigned int last;		/* Last docid in the group */
+  unsigned int maxhits;		/* Most hits of a document in the group */
+};
+
+/* First byte of a block compressed chunk. Chunks in the original
+ * format start with a docid, which is always below 2^31, so a first
+ * byte with the high bit set is a format version.
+ */
+#define BLOB_FORMAT_BLOCKS 0x81
+
+/* Number of documents in a block of a block compressed chunk. */
+#define BLOB_BLOCK_SIZE 128
+
 typedef struct _Blob
 {
   struct svalue *feed;
@@ -7,6 +24,25 @@ typedef struct _Blob
   unsigned int eof;
 
   struct buffer *b;
+
+  /* Skip table for the current buffer, built on demand by
+   * wf_blob_skip_to. nskip is -1 when it has not been built.
+   */
+  struct blob_skip *skip;
+  int nskip, skip_size;
+  unsigned int last_docid;
+
+  /* Set when the current buffer is a block compressed chunk. Its
+   * blocks are decoded one at a time into block_docids, and rpos is
+   * then the offset of the next block.
+   */
+  int format;
+  int block_n, block_pos;
+  unsigned int block_last, block_max;
+  unsigned char *block_nhits;
+  unsigned char *block_hits;
+  unsigned int block_docids[BLOB_BLOCK_SIZE];
+  unsigned int block_hitoff[BLOB_BLOCK_SIZE];
 } Blob;
 
 typedef enum {
@@ -55,6 +91,20 @@ int wf_blob_hit_raw( Blob *b, int n );
  * nhits.
  */
 
+int wf_blob_skip_to( Blob *b, unsigned int docid );
+/* Move forward to the first document with an id greater than or
+ * equal to docid, and return its id, or -1 if there is no such
+ * document. Documents in between are passed over without looking at
+ * their hits.
+ */
+
+int wf_blob_block_max( Blob *b );
+unsigned int wf_blob_block_last( Blob *b );
+/* Return the largest number of hits of any document from the current
+ * one up to and including the document wf_blob_block_last() returns.
+ * Documents in later chunks are not covered.
+ */
+
 int wf_blob_docid( Blob *b );
 /* Return the current document-id of the blob, same as the value
  * returned from wf_blob_next()
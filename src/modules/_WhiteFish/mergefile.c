@@ -0,0 +1,400 @@
+#include "global.h"
+#include "stralloc.h"
+#include "global.h"
+#include "pike_macros.h"
+#include "interpret.h"
+#include "program.h"
+#include "object.h"
+#include "array.h"
+#include "module_support.h"
+#include "fdlib.h"
+#include "threads.h"
+
+#include "config.h"
+
+#include "whitefish.h"
+#include "mergefile.h"
+
+/*
+  A merge file is a sequence of records sorted on the word:
+
+  +------------+-------+------------+------+
+  | wordlen:32 | word  | bloblen:32 | blob |...
+  +------------+-------+------------+------+
+*/
+
+#define MERGE_BUFSIZE 65536
+
+struct merge_input
+{
+  int fd;
+  unsigned char *buf;
+  size_t pos, len;
+
+  /* The current record, word followed by blob. */
+  unsigned char *rec;
+  size_t rec_size;
+  unsigned int word_len, blob_len;
+};
+
+struct merge_state
+{
+  struct merge_input *in;
+  int nin;
+  int *heap;
+  int nheap;
+  int out;
+  unsigned char *obuf;
+  size_t olen;
+  const char *error;
+  int err;
+};
+
+/* Read n bytes from the input. Returns the number of bytes read, which
+ * is less than n at the end of the file, or -1 on error.
+ */
+static ptrdiff_t merge_read( struct merge_input *in, unsigned char *dst,
+			     size_t n )
+{
+  size_t got = 0;
+  while( got < n )
+  {
+    size_t c;
+    if( in->pos == in->len )
+    {
+      ptrdiff_t r;
+      do
+	r = fd_read( in->fd, in->buf, MERGE_BUFSIZE );
+      while( r < 0 && errno == EINTR );
+      if( r < 0 )
+	return -1;
+      if( !r )
+	break;
+      in->pos = 0;
+      in->len = r;
+    }
+    c = MINIMUM( n - got, in->len - in->pos );
+    memcpy( dst + got, in->buf + in->pos, c );
+    in->pos += c;
+    got += c;
+  }
+  return got;
+}
+
+static unsigned int merge_rint( unsigned char *d )
+{
+  return (((((d[0]<<8) | d[1])<<8) | d[2])<<8) | d[3];
+}
+
+static int merge_reserve( struct merge_input *in, size_t size )
+{
+  unsigned char *rec;
+  if( size <= in->rec_size )
+    return 1;
+  if( !(rec = realloc( in->rec, size )) )
+    return 0;
+  in->rec = rec;
+  in->rec_size = size;
+  return 1;
+}
+
+/* Read the next record of the input into in->rec. Returns 1 if there
+ * is one, 0 at the end of the file and -1 on error.
+ */
+static int merge_next( struct merge_state *s, struct merge_input *in )
+{
+  unsigned char len[4];
+  ptrdiff_t r;
+
+  if( (r = merge_read( in, len, 4 )) != 4 )
+  {
+    if( !r )
+      return 0;
+    goto failed;
+  }
+  in->word_len = merge_rint( len );
+  if( !merge_reserve( in, in->word_len ) )
+    goto oom;
+  if( (r = merge_read( in, in->rec, in->word_len )) !=
+      (ptrdiff_t)in->word_len ||
+      (r = merge_read( in, len, 4 )) != 4 )
+    goto failed;
+  in->blob_len = merge_rint( len );
+  if( !merge_reserve( in, (size_t)in->word_len + in->blob_len ) )
+    goto oom;
+  if( (r = merge_read( in, in->rec + in->word_len, in->blob_len )) !=
+      (ptrdiff_t)in->blob_len )
+    goto failed;
+  return 1;
+
+failed:
+  /* A short read without an error means that the file is truncated. */
+  s->error = r < 0 ? "Failed to read merge file" : "Truncated merge file";
+  s->err = r < 0 ? errno : 0;
+  return -1;
+oom:
+  s->error = "Out of memory";
+  return -1;
+}
+
+static int merge_flush( struct merge_state *s )
+{
+  size_t done = 0;
+  while( done < s->olen )
+  {
+    ptrdiff_t w = fd_write( s->out, s->obuf + done, s->olen - done );
+    if( w < 0 && errno == EINTR )
+      continue;
+    if( w <= 0 )
+    {
+      s->error = "Failed to write merge file";
+      s->err = errno;
+      return 0;
+    }
+    done += w;
+  }
+  s->olen = 0;
+  return 1;
+}
+
+static int merge_write( struct merge_state *s, unsigned char *data,
+			size_t n )
+{
+  while( n )
+  {
+    size_t c;
+    if( s->olen == MERGE_BUFSIZE && !merge_flush( s ) )
+      return 0;
+    c = MINIMUM( n, MERGE_BUFSIZE - s->olen );
+    memcpy( s->obuf + s->olen, data, c );
+    s->olen += c;
+    data += c;
+    n -= c;
+  }
+  return 1;
+}
+
+static int merge_wint( struct merge_state *s, unsigned int i )
+{
+  unsigned char d[4];
+  d[0] = i>>24; d[1] = i>>16; d[2] = i>>8; d[3] = i;
+  return merge_write( s, d, 4 );
+}
+
+/* Order on the word, and on the input for equal words, so that the
+ * blobs of a word are concatenated in the order of the inputs.
+ */
+static int merge_cmp( struct merge_state *s, int a, int b )
+{
+  struct merge_input *x = s->in + a, *y = s->in + b;
+  int c = memcmp( x->rec, y->rec, MINIMUM( x->word_len, y->word_len ) );
+  if( c )
+    return c;
+  if( x->word_len != y->word_len )
+    return x->word_len < y->word_len ? -1 : 1;
+  return a - b;
+}
+
+static void merge_sift_down( struct merge_state *s, int i )
+{
+  int *h = s->heap;
+  while( 1 )
+  {
+    int c = i*2 + 1, t;
+    if( c >= s->nheap )
+      break;
+    if( c + 1 < s->nheap && merge_cmp( s, h[c+1], h[c] ) < 0 )
+      c++;
+    if( merge_cmp( s, h[i], h[c] ) <= 0 )
+      break;
+    t = h[i]; h[i] = h[c]; h[c] = t;
+    i = c;
+  }
+}
+
+static void merge_sift_up( struct merge_state *s, int i )
+{
+  int *h = s->heap;
+  while( i )
+  {
+    int p = (i - 1) / 2, t;
+    if( merge_cmp( s, h[p], h[i] ) <= 0 )
+      break;
+    t = h[i]; h[i] = h[p]; h[p] = t;
+    i = p;
+  }
+}
+
+/* The merge itself. Does not touch any Pike data, and runs without
+ * the interpreter lock.
+ */
+static void low_merge_files( struct merge_state *s )
+{
+  int i, *same;
+
+  if( !(same = malloc( (s->nin + 1) * sizeof(int) )) )
+  {
+    s->error = "Out of memory";
+    return;
+  }
+
+  for( i = 0; i<s->nin; i++ )
+  {
+    int r = merge_next( s, s->in + i );
+    if( r < 0 )
+      goto done;
+    if( r )
+    {
+      s->heap[s->nheap++] = i;
+      merge_sift_up( s, s->nheap - 1 );
+    }
+  }
+
+  while( s->nheap )
+  {
+    struct merge_input *first = s->in + s->heap[0];
+    unsigned int blob_len = 0;
+    int n = 0;
+
+    /* Take all inputs with the same word off the heap. */
+    do
+    {
+      same[n++] = s->heap[0];
+      s->heap[0] = s->heap[--s->nheap];
+      merge_sift_down( s, 0 );
+    } while( s->nheap &&
+	     s->in[s->heap[0]].word_len == first->word_len &&
+	     !memcmp( s->in[s->heap[0]].rec, first->rec, first->word_len ) );
+
+    for( i = 0; i<n; i++ )
+      blob_len += s->in[same[i]].blob_len;
+
+    if( !merge_wint( s, first->word_len ) ||
+	!merge_write( s, first->rec, first->word_len ) ||
+	!merge_wint( s, blob_len ) )
+      goto done;
+    for( i = 0; i<n; i++ )
+    {
+      struct merge_input *in = s->in + same[i];
+      if( !merge_write( s, in->rec + in->word_len, in->blob_len ) )
+	goto done;
+    }
+
+    for( i = 0; i<n; i++ )
+    {
+      int r = merge_next( s, s->in + same[i] );
+      if( r < 0 )
+	goto done;
+      if( r )
+      {
+	s->heap[s->nheap++] = same[i];
+	merge_sift_up( s, s->nheap - 1 );
+      }
+    }
+  }
+
+  merge_flush( s );
+
+done:
+  free( same );
+}
+
+static void free_merge_state( struct merge_state *s )
+{
+  int i;
+  for( i = 0; i<s->nin; i++ )
+  {
+    if( s->in[i].fd >= 0 )
+      fd_close( s->in[i].fd );
+    free( s->in[i].buf );
+    free( s->in[i].rec );
+  }
+  if( s->out >= 0 )
+    fd_close( s->out );
+  free( s->in );
+  free( s->heap );
+  free( s->obuf );
+}
+
+/*! @module Search
+ */
+
+static void f_merge_files( INT32 args )
+/*! @decl void merge_files( array(string) inputs, string output )
+ *!
+ *! Merge the word sorted files @[inputs], as written by
+ *! @[Search.MergeFile()->write_blobs()], into the file @[output] in a
+ *! single pass. The blobs of a word that is present in several of the
+ *! files are concatenated in the order of @[inputs].
+ *!
+ *! Only a fixed size buffer and the current record of each input are
+ *! kept in memory, and the merge runs without the interpreter lock.
+ */
+{
+  struct array *inputs;
+  char *output;
+  struct merge_state s;
+  ONERROR err;
+  int i;
+
+  get_all_args( "merge_files", args, "%a%c", &inputs, &output );
+
+  for( i = 0; i<inputs->size; i++ )
+    if( TYPEOF(inputs->item[i]) != PIKE_T_STRING ||
+	inputs->item[i].u.string->size_shift ||
+	string_has_null( inputs->item[i].u.string ) )
+      SIMPLE_ARG_TYPE_ERROR( "merge_files", 1, "array(string(1..255))" );
+
+  memset( &s, 0, sizeof(s) );
+  s.out = -1;
+  s.in = xcalloc( inputs->size + 1, sizeof(struct merge_input) );
+  s.nin = inputs->size;
+  for( i = 0; i<s.nin; i++ )
+    s.in[i].fd = -1;
+  SET_ONERROR( err, free_merge_state, &s );
+
+  s.heap = xalloc( (s.nin + 1) * sizeof(int) );
+  s.obuf = xalloc( MERGE_BUFSIZE );
+  for( i = 0; i<s.nin; i++ )
+  {
+    s.in[i].buf = xalloc( MERGE_BUFSIZE );
+    do
+      s.in[i].fd = fd_open( inputs->item[i].u.string->str, fd_RDONLY, 0 );
+    while( s.in[i].fd < 0 && errno == EINTR );
+    if( s.in[i].fd < 0 )
+      Pike_error( "Failed to open %S: %s\n", inputs->item[i].u.string,
+		  strerror( errno ) );
+  }
+  do
+    s.out = fd_open( output, fd_WRONLY|fd_CREAT|fd_TRUNC, 0666 );
+  while( s.out < 0 && errno == EINTR );
+  if( s.out < 0 )
+    Pike_error( "Failed to open %s: %s\n", output, strerror( errno ) );
+
+  THREADS_ALLOW();
+  low_merge_files( &s );
+  THREADS_DISALLOW();
+
+  if( s.error )
+  {
+    if( s.err )
+      Pike_error( "%s: %s\n", s.error, strerror( s.err ) );
+    Pike_error( "%s\n", s.error );
+  }
+
+  CALL_AND_UNSET_ONERROR( err );
+  pop_n_elems( args );
+}
+
+/*! @endmodule
+ */
+
+void init_mergefile_program(void)
+{
+  ADD_FUNCTION( "merge_files", f_merge_files,
+		tFunc( tArr(tStr) tStr, tVoid ), 0 );
+}
+
+void exit_mergefile_program(void)
+{
+}
@@ -0,0 +1,2 @@
+void init_mergefile_program(void);
+void exit_mergefile_program(void);
@@ -10,6 +10,7 @@
 #include "array.h"
 #include "module_support.h"
 #include "module.h"
+#include "fsort.h"
 
 #include "config.h"
 
@@ -18,6 +19,7 @@
 #include "blob.h"
 #include "blobs.h"
 #include "linkfarm.h"
+#include "mergefile.h"
 
 struct  tofree
 {
@@ -25,6 +27,8 @@ struct  tofree
   Blob **tmp;
   int nblobs;
   struct object *res;
+  void *scratch;
+  void *top;
 };
 
 static void free_stuff( void *_t )
@@ -36,6 +40,8 @@ static void free_stuff( void *_t )
     wf_blob_free( t->blobs[i] );
   free(t->blobs);
   free( t->tmp );
+  free( t->scratch );
+  free( t->top );
   free( t );
 }
 
@@ -58,23 +64,34 @@ static int _distance_f( int distance )
 }
 
 
-static void handle_hit( Blob **blobs,
+/* Work area for handle_hit and handle_phrase_hit, allocated once per
+ * query instead of once per matching document.
+ */
+static void *alloc_scratch( int nblobs )
+{
+  return xalloc( nblobs * (sizeof(Hit) + 2) );
+}
+
+/* Returns the ranking of the document the blobs are at, or 0 if it
+ * does not match.
+ */
+static int handle_hit( Blob **blobs,
 			int nblobs,
-			struct object *res,
-			int docid,
 			double *field_c[65],
 			double *prox_c[8],
 			double mc, double mp,
-			int cutoff )
+			int cutoff,
+			void *scratch )
 {
   int i, j, k, end = 0;
-  Hit *hits = calloc( nblobs, sizeof(Hit) );
-  unsigned char *nhits = malloc( nblobs );
-  unsigned char *pos = malloc( nblobs );
+  Hit *hits = scratch;
+  unsigned char *nhits = (unsigned char *)(hits + nblobs);
+  unsigned char *pos = nhits + nblobs;
 
   int matrix[65][8];
 
   memset(matrix, 0, sizeof(matrix) );
+  memset(hits, 0, nblobs * sizeof(Hit) );
 
   for( i = 0; i<nblobs; i++ )
     nhits[i] = wf_blob_nhits( blobs[i] );
@@ -100,9 +117,6 @@ static void handle_hit( Blob **blobs,
     }
   }
 
-  free( pos );
-  free( nhits );
-  free( hits );
   /* Now we have our nice matrix. Time to do some multiplication */
 
   {
@@ -119,28 +133,82 @@ static void handle_hit( Blob **blobs,
       accum = 32000.0;
     accum_i = (int)(accum *100 ) + 1;
     if( accum > 0.0 )
-      wf_resultset_add( res, docid, accum_i );
+      return accum_i;
+    return 0;
   }
 }
 
+/* The best ranking handle_hit can give a document for the given sum
+ * of per word bounds.
+ */
+static int bound_score( double accum )
+{
+  if( accum > 32000.0 )
+    accum = 32000.0;
+  return (int)(accum*100) + 1;
+}
+
+struct top_doc
+{
+  int docid;
+  int score;
+};
+
+static int cmp_top_doc( struct top_doc *a, struct top_doc *b )
+{
+  return a->docid < b->docid ? -1 : a->docid == b->docid ? 0 : 1;
+}
+
+/* Add a document to the heap of the max best ones found so far. The
+ * worst of them is top[0] once the heap is full.
+ */
+static void top_add( struct top_doc *top, int *n, int max,
+		     int docid, int score )
+{
+  int i, c;
+  if( *n < max )
+  {
+    for( i = (*n)++; i && top[(i-1)/2].score > score; i = (i-1)/2 )
+      top[i] = top[(i-1)/2];
+  }
+  else if( score > top[0].score )
+  {
+    for( i = 0; (c = 2*i+1) < max; i = c )
+    {
+      if( c+1 < max && top[c+1].score < top[c].score )
+	c++;
+      if( top[c].score >= score )
+	break;
+      top[i] = top[c];
+    }
+  }
+  else
+    return;
+  top[i].docid = docid;
+  top[i].score = score;
+}
+
 static struct object *low_do_query_or( Blob **blobs,
 					  int nblobs,
 					  double field_c[65],
 					  double prox_c[8],
-					  int cutoff)
+					  int cutoff,
+					  int top_k)
 {
   struct object *res = wf_resultset_new();
   struct tofree *__f = malloc( sizeof( struct tofree ) );
   double max_c=0.0, max_p=0.0;
   ONERROR e;
-  int i, j;
+  int i, j, r;
   Blob **tmp;
-  tmp = calloc( nblobs, sizeof( Blob *) );
+  tmp = calloc( nblobs*2, sizeof( Blob *) );
 
   __f->res = res;
   __f->blobs = blobs;
   __f->nblobs = nblobs;
   __f->tmp    = tmp;
+  __f->scratch = alloc_scratch( nblobs );
+  __f->top = 0;
   SET_ONERROR( e, free_stuff, __f );
 
 
@@ -152,7 +220,104 @@ static struct object *low_do_query_or( Blob **blobs,
     if( prox_c[i] > max_p )
       max_p = prox_c[i];
 
-  if( max_p != 0.0 && max_c != 0.0 )
+  if( max_p != 0.0 && max_c != 0.0 && top_k > 0 )
+  {
+    /* Only rank the documents that can get among the top_k best
+     * (MaxScore). The most hits of a word in its current block bounds
+     * what it adds to a ranking up to the end of the block. The words
+     * with the smallest bounds that together cannot beat the worst of
+     * the best documents so far are skipped forward to the documents
+     * of the other words instead of being walked through.
+     */
+    struct top_doc *top;
+    Blob **order = tmp + nblobs;
+    double *ub, hit_max;
+    int ntop = 0, prune = cutoff >= 0, n, ne;
+
+    top = __f->top = xalloc( top_k*sizeof(struct top_doc) +
+			     nblobs*sizeof(double) );
+    ub = (double *)(top + top_k);
+
+    /* One hit adds at most 1 to the spread 11-20 proximity and 4 for
+     * every other word to some proximity, before the weighting. The
+     * bound does not hold for negative coefficients.
+     */
+    hit_max = (prox_c[3] + 4*(nblobs-1)*max_p) / max_p;
+    for( i = 0; i<65; i++ )
+      if( field_c[i] < 0.0 )
+	prune = 0;
+    for( i = 0; i<8; i++ )
+      if( prox_c[i] < 0.0 )
+	prune = 0;
+
+    for( i = 0; i<nblobs; i++ ) /* Forward to first element */
+      wf_blob_next( blobs[i] );
+
+    while( 1 )
+    {
+      unsigned int horizon = 0xffffffff, cand = 0xffffffff, target;
+      int limit = prune && ntop == top_k ? top[0].score : 0;
+      double sum = 0.0;
+
+      /* Sort the words on their bounds, which all hold up to the
+       * horizon. */
+      for( n = 0, i = 0; i<nblobs; i++ )
+	if( !blobs[i]->eof )
+	{
+	  double bound = wf_blob_block_max( blobs[i] ) * hit_max;
+	  unsigned int last = wf_blob_block_last( blobs[i] );
+	  if( last < horizon )
+	    horizon = last;
+	  for( j = n++; j && ub[j-1] > bound; j-- )
+	  {
+	    ub[j] = ub[j-1];
+	    order[j] = order[j-1];
+	  }
+	  ub[j] = bound;
+	  order[j] = blobs[i];
+	}
+      if( !n )
+	break;
+
+      for( ne = 0; ne < n && bound_score( sum + ub[ne] ) <= limit; ne++ )
+	sum += ub[ne];
+      for( i = ne; i<n; i++ )
+	if( order[i]->docid < cand )
+	  cand = order[i]->docid;
+
+      /* Skip the other words to the next document of the words that
+       * can still make a difference, but not past the horizon. */
+      target = cand <= horizon ? cand : horizon + 1;
+      for( i = 0; i<ne; i++ )
+	if( order[i]->docid < target )
+	  wf_blob_skip_to( order[i], target );
+      if( cand > horizon )
+	continue;
+
+      for( sum = 0.0, j = 0, i = 0; i < nblobs; i++ )
+	if( !blobs[i]->eof && blobs[i]->docid == cand )
+	{
+	  sum += wf_blob_nhits( blobs[i] ) * hit_max;
+	  tmp[j++] = blobs[i];
+	}
+
+      if( bound_score( sum ) > limit )
+      {
+	int score = handle_hit( tmp, j, &field_c, &prox_c, max_c, max_p,
+				cutoff, __f->scratch );
+	if( score )
+	  top_add( top, &ntop, top_k, cand, score );
+      }
+
+      for( i = 0; i<j; i++ )
+	wf_blob_next( tmp[i] );
+    }
+
+    fsort( top, ntop, sizeof(struct top_doc), (void *)cmp_top_doc );
+    for( i = 0; i<ntop; i++ )
+      wf_resultset_add( res, top[i].docid, top[i].score );
+  }
+  else if( max_p != 0.0 && max_c != 0.0 )
   {
     /* Time to do the real work. :-) */
     for( i = 0; i<nblobs; i++ ) /* Forward to first element */
@@ -174,7 +339,9 @@ static struct object *low_do_query_or( Blob **blobs,
 	if( blobs[i]->docid == min && !blobs[i]->eof )
 	  tmp[j++] = blobs[i];
 
-      handle_hit( tmp, j, res, min, &field_c, &prox_c, max_c, max_p, cutoff );
+      if( (r = handle_hit( tmp, j, &field_c, &prox_c, max_c, max_p, cutoff,
+			   __f->scratch )) )
+	wf_resultset_add( res, min, r );
 
       for( i = 0; i<j; i++ )
 	wf_blob_next( tmp[i] );
@@ -193,10 +360,11 @@ static void handle_phrase_hit( Blob **blobs,
 			       struct object *res,
 			       int docid,
 			       double *field_c[65],
-			       double mc )
+			       double mc,
+			       void *scratch )
 {
   int i, j, k;
-  unsigned char *nhits = malloc( nblobs*2 );
+  unsigned char *nhits = scratch;
   unsigned char *first = nhits+nblobs;
   int matrix[65];
   double accum = 0.0;
@@ -237,8 +405,6 @@ static void handle_phrase_hit( Blob **blobs,
       accum += add/mc;
   }
 
-  free( nhits );
-
   if( accum > 0.0 )
     wf_resultset_add( res, docid, (int)(accum*100) );
 }
@@ -250,11 +416,13 @@ static struct object *low_do_query_phrase( Blob **blobs, int nblobs,
   struct tofree *__f = malloc( sizeof( struct tofree ) );
   double max_c=0.0;
   ONERROR e;
-  int i, j;
+  int i;
   __f->blobs = blobs;
   __f->nblobs = nblobs;
   __f->res = res;
   __f->tmp    = 0;
+  __f->scratch = alloc_scratch( nblobs );
+  __f->top = 0;
   SET_ONERROR( e, free_stuff, __f );
 
 
@@ -268,30 +436,30 @@ static struct object *low_do_query_phrase( Blob **blobs, int nblobs,
     for( i = 0; i<nblobs; i++ ) /* Forward to first element */
       wf_blob_next( blobs[i] );
 
-    /* Main loop: Find the smallest element in the blob array. */
+    /* Main loop: Skip all blobs forward to the largest current
+     * document until they agree on one. */
     while( 1 )
     {
-      unsigned int min = 0x7fffffff;
+      unsigned int max = 0;
 
       for( i = 0; i<nblobs; i++ )
 	if( blobs[i]->eof )
 	  goto end;
-	else if( ((unsigned int)blobs[i]->docid) < min )
-	  min = blobs[i]->docid;
+	else if( blobs[i]->docid > max )
+	  max = blobs[i]->docid;
 
-      if( min == 0x7fffffff )
-	goto end;
-
-      for( j = 0, i = 0; i < nblobs; i++ )
-	if( blobs[i]->docid != min )
+      for( i = 0; i < nblobs; i++ )
+	if( blobs[i]->docid != max &&
+	    wf_blob_skip_to( blobs[i], max ) != (int)max )
 	  goto next;
 
-      handle_phrase_hit( blobs, nblobs, res, min, &field_c, max_c );
+      handle_phrase_hit( blobs, nblobs, res, max, &field_c, max_c,
+			 __f->scratch );
 
-    next:
       for( i = 0; i<nblobs; i++ )
-	if( blobs[i]->docid == min )
-	  wf_blob_next( blobs[i] );
+	wf_blob_next( blobs[i] );
+    next:
+      ;
     }
   }
 end:
@@ -312,11 +480,13 @@ static struct object *low_do_query_and( Blob **blobs, int nblobs,
   struct tofree *__f = malloc( sizeof( struct tofree ) );
   double max_c=0.0, max_p=0.0;
   ONERROR e;
-  int i, j;
+  int i, r;
   __f->blobs = blobs;
   __f->nblobs = nblobs;
   __f->res = res;
   __f->tmp    = 0;
+  __f->scratch = alloc_scratch( nblobs );
+  __f->top = 0;
   SET_ONERROR( e, free_stuff, __f );
 
 
@@ -334,31 +504,31 @@ static struct object *low_do_query_and( Blob **blobs, int nblobs,
     for( i = 0; i<nblobs; i++ ) /* Forward to first element */
       wf_blob_next( blobs[i] );
 
-    /* Main loop: Find the smallest element in the blob array. */
+    /* Main loop: Skip all blobs forward to the largest current
+     * document until they agree on one. */
     while( 1 )
     {
-      unsigned int min = 0x7fffffff;
+      unsigned int max = 0;
 
       for( i = 0; i<nblobs; i++ )
 	if( blobs[i]->eof )
 	  goto end;
-	else if( ((unsigned int)blobs[i]->docid) < min )
-	  min = blobs[i]->docid;
-
-      if( min == 0x7fffffff )
-	goto end;
+	else if( blobs[i]->docid > max )
+	  max = blobs[i]->docid;
 
-      for( j = 0, i = 0; i < nblobs; i++ )
-	if( blobs[i]->docid != min )
+      for( i = 0; i < nblobs; i++ )
+	if( blobs[i]->docid != max &&
+	    wf_blob_skip_to( blobs[i], max ) != (int)max )
 	  goto next;
 
-      handle_hit( blobs, nblobs, res, min, &field_c,&prox_c, max_c,max_p,
-		  cutoff );
+      if( (r = handle_hit( blobs, nblobs, &field_c,&prox_c, max_c,max_p,
+			   cutoff, __f->scratch )) )
+	wf_resultset_add( res, max, r );
 
-    next:
       for( i = 0; i<nblobs; i++ )
-	if( blobs[i]->docid == min )
-	  wf_blob_next( blobs[i] );
+	wf_blob_next( blobs[i] );
+    next:
+      ;
     }
   }
 end:
@@ -544,7 +714,8 @@ static void f_do_query_or( INT32 args )
  *!                              array(int) field_coefficients,       @
  *!                              array(int) proximity_coefficients,   @
  *!                              int cutoff,			      @
- *!                              function(string,int,int:string) blobfeeder)
+ *!                              function(string,int,int:string) blobfeeder, @
+ *!                              void|int top_k)
  *! @param words
  *!
  *! Arrays of word ids. Note that the order is significant for the
@@ -591,11 +762,18 @@ static void f_do_query_or( INT32 args )
  *!
  *! This function returns a Pike string containing the word hits for a
  *! certain word. Call repeatedly until it returns @expr{0@}.
+ *!
+ *! @param top_k
+ *!
+ *! If given and positive, only the @[top_k] documents with the best
+ *! ranking are returned. Documents that cannot get among them are
+ *! then not ranked, and the hits of words that cannot make a
+ *! difference on their own are skipped over block by block.
  */
 {
   double proximity_coefficients[8];
   double field_coefficients[65];
-  int numblobs, i, cutoff;
+  int numblobs, i, cutoff, top_k = 0;
   Blob **blobs;
 
   struct svalue *cb;
@@ -603,8 +781,8 @@ static void f_do_query_or( INT32 args )
   struct array *_words, *_field, *_prox;
 
   /* 1: Get all arguments. */
-  get_all_args( "do_query_or", args, "%a%a%a%d%*",
-		&_words, &_field, &_prox, &cutoff, &cb);
+  get_all_args( "do_query_or", args, "%a%a%a%d%*.%d",
+		&_words, &_field, &_prox, &cutoff, &cb, &top_k);
 
   if( _field->size != 65 )
     Pike_error("Illegal size of field_coefficients array (expected 65)\n" );
@@ -634,7 +812,7 @@ static void f_do_query_or( INT32 args )
   res = low_do_query_or(blobs,numblobs,
 			field_coefficients,
 			proximity_coefficients,
-			cutoff );
+			cutoff, top_k );
   pop_n_elems( args );
   wf_resultset_push( res );
 }
@@ -649,10 +827,11 @@ PIKE_MODULE_INIT
   init_blob_program();
   init_blobs_program();
   init_linkfarm_program();
+  init_mergefile_program();
 
   ADD_FUNCTION( "do_query_or", f_do_query_or,
                 tFunc( tArr(tStr) tArr(tInt) tArr(tInt) tInt
-                       tFunc(tStr tInt tInt, tStr), tObj), 0 );
+                       tFunc(tStr tInt tInt, tStr) tOr(tInt,tVoid), tObj), 0 );
 
   ADD_FUNCTION( "do_query_and", f_do_query_and,
                 tFunc( tArr(tStr) tArr(tInt) tArr(tInt) tInt
@@ -669,4 +848,5 @@ PIKE_MODULE_EXIT
   exit_blob_program();
   exit_blobs_program();
   exit_linkfarm_program();
+  exit_mergefile_program();
 }
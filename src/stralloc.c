@@ -18,10 +18,15 @@
 #include "pike_float.h"
 #include "pike_types.h"
 #include "block_allocator.h"
+#include "bitvector.h"
 
 #include <errno.h>
 #include <ctype.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define SET_HSIZE(X) htable_mask=(htable_size=(X))-1
 #define HMODULO(X) ((X) & (htable_mask))
 
@@ -315,12 +320,142 @@ PMOD_EXPORT struct pike_string *debug_check_size_shift(const struct pike_string
     while(--len>=0) *(to++)= (PIKE_CONCAT (p_wchar, TO)) *(from++);	\
   }
 
+CONVERT(1,2)
+CONVERT(2,1)
+
+#ifdef __SSE2__
+/* Widening and narrowing of 8bit data, which is what most of the
+ * transcoding ends up doing, is done 16 characters at a time.
+ * Narrowing keeps the low bits like the scalar code does.
+ */
+void convert_0_to_1(p_wchar1 *to, const p_wchar0 *from, ptrdiff_t len)
+{
+  const __m128i zero = _mm_setzero_si128();
+  for (; len >= 16; len -= 16, from += 16, to += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)from);
+    _mm_storeu_si128((__m128i *)to, _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128((__m128i *)(to + 8), _mm_unpackhi_epi8(v, zero));
+  }
+  while(--len>=0) *(to++) = *(from++);
+}
+
+void convert_0_to_2(p_wchar2 *to, const p_wchar0 *from, ptrdiff_t len)
+{
+  const __m128i zero = _mm_setzero_si128();
+  for (; len >= 16; len -= 16, from += 16, to += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)from);
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    _mm_storeu_si128((__m128i *)to, _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(to + 4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(to + 8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i *)(to + 12), _mm_unpackhi_epi16(hi, zero));
+  }
+  while(--len>=0) *(to++) = *(from++);
+}
+
+void convert_1_to_0(p_wchar0 *to, const p_wchar1 *from, ptrdiff_t len)
+{
+  const __m128i mask = _mm_set1_epi16(0xff);
+  for (; len >= 16; len -= 16, from += 16, to += 16) {
+    __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)from), mask);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(from + 8)),
+			      mask);
+    _mm_storeu_si128((__m128i *)to, _mm_packus_epi16(a, b));
+  }
+  while(--len>=0) *(to++) = (p_wchar0)*(from++);
+}
+
+void convert_2_to_0(p_wchar0 *to, const p_wchar2 *from, ptrdiff_t len)
+{
+  const __m128i mask = _mm_set1_epi32(0xff);
+  for (; len >= 16; len -= 16, from += 16, to += 16) {
+    __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)from), mask);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(from + 4)),
+			      mask);
+    __m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i *)(from + 8)),
+			      mask);
+    __m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i *)(from + 12)),
+			      mask);
+    _mm_storeu_si128((__m128i *)to,
+		     _mm_packus_epi16(_mm_packs_epi32(a, b),
+				      _mm_packs_epi32(c, d)));
+  }
+  while(--len>=0) *(to++) = (p_wchar0)*(from++);
+}
+#else /* !__SSE2__ */
 CONVERT(0,1)
 CONVERT(0,2)
 CONVERT(1,0)
-CONVERT(1,2)
 CONVERT(2,0)
-CONVERT(2,1)
+#endif /* __SSE2__ */
+
+/* Returns the number of leading 7bit characters in str[0..len-1],
+ * ie the index of the first character outside 0..127, or len.
+ */
+PMOD_EXPORT ptrdiff_t ascii_prefix_length(const PCHARP str, ptrdiff_t len)
+{
+  ptrdiff_t i = 0;
+
+  switch(str.shift) {
+  case 0:
+    {
+      const p_wchar0 *s = str.ptr;
+#ifdef __SSE2__
+      for (; i + 16 <= len; i += 16) {
+	int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+	if (mask) return i + ctz32(mask);
+      }
+#else
+      /* Check a word at a time. */
+      const size_t high_bits = ~(size_t)0/0xff * 0x80;
+      for (; i + (ptrdiff_t)sizeof(size_t) <= len; i += sizeof(size_t)) {
+	size_t w;
+	memcpy(&w, s + i, sizeof(w));
+	if (w & high_bits) break;
+      }
+#endif
+      for (; i < len; i++)
+	if (s[i] & 0x80) break;
+    }
+    break;
+  case 1:
+    {
+      const p_wchar1 *s = str.ptr;
+#ifdef __SSE2__
+      const __m128i high = _mm_set1_epi16((short)0xff80);
+      const __m128i zero = _mm_setzero_si128();
+      for (; i + 8 <= len; i += 8) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+	int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high),
+						     zero)) ^ 0xffff;
+	if (mask) return i + (ctz32(mask) >> 1);
+      }
+#endif
+      for (; i < len; i++)
+	if (s[i] & ~0x7f) break;
+    }
+    break;
+  case 2:
+    {
+      const p_wchar2 *s = str.ptr;
+#ifdef __SSE2__
+      const __m128i high = _mm_set1_epi32(~0x7f);
+      const __m128i zero = _mm_setzero_si128();
+      for (; i + 4 <= len; i += 4) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+	int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, high),
+						     zero)) ^ 0xffff;
+	if (mask) return i + (ctz32(mask) >> 2);
+      }
+#endif
+      for (; i < len; i++)
+	if ((unsigned INT32)s[i] & ~0x7f) break;
+    }
+    break;
+  }
+  return i;
+}
 
 #define TWO_SIZES(X,Y) (((X)<<2)+(Y))
 
@@ -931,6 +1066,39 @@ PMOD_EXPORT struct pike_string * debug_make_shared_binary_string(const char *str
   return s;
 }
 
+/* Make a shared 8bit string that takes over the malloced block str,
+ * which must have room for at least len+1 bytes. The block is freed
+ * if an identical string already exists.
+ */
+PMOD_EXPORT struct pike_string *make_shared_malloced_binary_string(char *str,
+								  size_t len)
+{
+  struct pike_string *s;
+  ptrdiff_t h = StrHash(str, len);
+
+  s = internal_findstring(str,len,0,h);
+  if (s)
+  {
+    free(str);
+    add_ref(s);
+    return s;
+  }
+
+  s = ba_alloc(&string_allocator);
+  s->flags = STRING_NOT_HASHED|STRING_NOT_SHARED;
+  s->size_shift = 0;
+  s->alloc_type = STRING_ALLOC_MALLOC;
+  s->struct_type = STRING_STRUCT_STRING;
+  s->str = str;
+  s->refs = 0;
+  s->len = len;
+  add_ref(s);	/* For DMALLOC */
+  DO_IF_DEBUG(s->next = NULL);
+  low_set_index(s,len,0);
+  link_pike_string(s, h);
+  return s;
+}
+
 PMOD_EXPORT struct pike_string * debug_make_shared_binary_pcharp(const PCHARP str,size_t len)
 {
   switch(str.shift)
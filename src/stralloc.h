@@ -298,6 +298,7 @@ int safe_debug_findstring(const struct pike_string *foo);
 void generic_memcpy(PCHARP to,
                     const PCHARP from,
                     ptrdiff_t len);
+PMOD_EXPORT ptrdiff_t ascii_prefix_length(const PCHARP str, ptrdiff_t len);
 PMOD_EXPORT void pike_string_cpy(PCHARP to, const struct pike_string *from);
 struct pike_string *binary_findstring(const char *str, ptrdiff_t len);
 struct pike_string *findstring(const char *foo);
@@ -308,6 +309,8 @@ PMOD_EXPORT struct pike_string *low_end_shared_string(struct pike_string *s);
 PMOD_EXPORT struct pike_string *end_shared_string(struct pike_string *s);
 PMOD_EXPORT struct pike_string *end_and_resize_shared_string(struct pike_string *str, ptrdiff_t len) ;
 PMOD_EXPORT struct pike_string * debug_make_shared_binary_string(const char *str,size_t len);
+PMOD_EXPORT struct pike_string *make_shared_malloced_binary_string(char *str,
+								  size_t len);
 PMOD_EXPORT struct pike_string * debug_make_shared_binary_pcharp(const PCHARP str,size_t len);
 PMOD_EXPORT struct pike_string * debug_make_shared_pcharp(const PCHARP str);
 PMOD_EXPORT struct pike_string * debug_make_shared_binary_string0(const p_wchar0 *str,size_t len);